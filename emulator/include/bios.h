@@ -2,9 +2,10 @@
 #define BIOS_H
 #include <stdint.h>
 #include <stddef.h>
-#include <dirent.h>
 #include "cpu.h"
 #include "disk.h"
+#include "hostfs.h"
+#include "library.h"
 
 #define MAX_FILES 100
 #define INPUT_BUFFER_SIZE 256
@@ -16,6 +17,8 @@ typedef struct {
     int selected_file;
     char* program_file;
     char* program_output;
+    size_t output_len;
+    size_t output_cap;
     int initial_screen;
     size_t input_length;
     char input_buffer[INPUT_BUFFER_SIZE];
@@ -25,11 +28,20 @@ typedef struct {
     int history_count;
     int history_index;
     Disk* disk;
+    unsigned disk_irq_signaled;
+    Library* library;
+    HostFs* hostfs;
+    unsigned library_generation;
 } BIOS;
 
 BIOS* bios_init();
 void bios_cleanup(BIOS* bios);
 void bios_handle_interrupt(CPU* cpu, BIOS* bios);
 void bios_poll_input(BIOS* bios);
+void bios_refresh_programs(BIOS* bios);
+int bios_load_program(CPU* cpu, BIOS* bios, int index);
+void bios_service_irqs(CPU* cpu, BIOS* bios);
+void bios_console_append(BIOS* bios, const char* text, size_t len);
+void bios_console_clear(BIOS* bios);
 
 #endif
@@ -3,6 +3,18 @@
 #include <stdint.h>
 #include <stddef.h>
 #define NUM_REGISTERS 4
+
+// Interrupt vector table: one word per INT number, stored in guest memory.
+// A vector of 0 or in the BIOS range (0xFF00-0xFFFF) is a BIOS default and is
+// serviced natively; any other value is a guest handler address (in bytes).
+#define IVT_BASE    0x0000
+#define IVT_ENTRIES 32
+#define IVT_NATIVE  0xFF00
+// Compact one-word forms carry the operand in the instruction word itself.
+// Modes 16-23: reg, imm with imm = sign-extended reg2:mode[2:0] (-32..31).
+// Modes 24-31: jump/call to next PC + sign-extended reg1:reg2:mode[2:0] words (-256..255).
+#define MODE_SHORT_IMM    16
+#define MODE_SHORT_BRANCH 24
 typedef struct {
     uint16_t registers[NUM_REGISTERS];
     uint16_t pc;
@@ -11,16 +23,27 @@ typedef struct {
     size_t   stack_size;
     uint16_t* memory;
     size_t   program_size;
+    size_t   code_start;        // Word range of the loaded text, for decode caches
+    size_t   code_end;
     int      running;
     uint16_t interrupt;
     int      zero_flag;
     int      carry_flag;
     int      sign_flag;
+    int      irq_active;
+    uint64_t* profile;          // Executions per word address, NULL unless profiling
 } CPU;
 CPU*    cpu_init(size_t memory_size, size_t stack_size);
-void    cpu_load_program(CPU* cpu, const char* filename);
+int     cpu_load_program(CPU* cpu, const char* filename);
+int     cpu_check_image(CPU* cpu, const uint8_t* image, size_t size);
+int     cpu_load_image(CPU* cpu, const uint8_t* image, size_t size);
 void    cpu_execute_instruction(CPU* cpu);
 void    cpu_cleanup(CPU* cpu);
+void    cpu_reset_vectors(CPU* cpu);
+int     cpu_raise_interrupt(CPU* cpu, uint16_t n);
+int     cpu_raise_irq(CPU* cpu, uint16_t n);
 uint8_t cpu_read_byte (CPU* cpu, uint16_t address);
 void    cpu_write_byte(CPU* cpu, uint16_t address, uint8_t value);
+int     cpu_profile_start(CPU* cpu);
+int     cpu_profile_write(CPU* cpu, const char* path);
 #endif
@@ -3,18 +3,125 @@
 #include <stdint.h>
 #include <stdio.h>
 
-#define DISK_SIZE 1048576  // 1 MB
+#define DISK_SIZE 1048576  // Default and minimum image size, 1 MB
+#define DISK_MAX_SIZE 0x80000000ULL // 2 GB; byte addresses stay within 32 bits
+#define DISK_SECTOR_SIZE 512 // Unit of the block-addressed INT 10 functions
+#define DISK_RAW_SIZE 0x10000 // Raw area at the start of the image (INT 10 0x01/0x02)
 #define DISK_FILE "disk.img"
 #define MAX_FILENAME 64
+#define DISK_QUEUE_DEPTH 16 // Max async requests in flight (submitted but not yet polled)
+#define DISK_IRQ 11         // Interrupt raised when an async request completes
+#define DISK_CACHE_PAGES 16 // Default page cache size for the buffered backend
+#define DISK_MAX_READAHEAD 8
+#define DISK_COMMIT_MS 50   // Default journal group commit window
+#define DISK_RING_ENTRIES 64 // io_uring submission queue size for the uring backend
 
 typedef struct Disk Disk;
 
+typedef enum {
+    DISK_BACKEND_MMAP,      // Image mapped into memory; reads/writes are memcpy
+    DISK_BACKEND_BUFFERED,  // pread/pwrite through an LRU page cache
+    DISK_BACKEND_URING      // Page cache with transfers batched through io_uring (Linux)
+} DiskBackend;
+
+// Runtime disk configuration. disk_default_options fills in defaults and
+// applies CORX_DISK_* environment overrides.
+typedef struct {
+    const char* path;       // CORX_DISK_IMAGE
+    uint64_t size;          // CORX_DISK_SIZE (K/M/G suffix allowed); existing larger images keep their size
+    DiskBackend backend;    // CORX_DISK_BACKEND=mmap|buffered|uring
+    int cache_pages;        // CORX_DISK_CACHE_PAGES
+    int readahead;          // CORX_DISK_READAHEAD, max blocks read ahead
+    const char* template_path; // CORX_DISK_TEMPLATE, cloned when the image is missing
+    const char* base_path;  // CORX_DISK_BASE: path is then a copy-on-write overlay of this read-only image
+    int preallocate;        // CORX_DISK_PREALLOCATE=1 allocates instead of leaving the image sparse
+    int commit_ms;          // CORX_DISK_COMMIT_MS, journal group commit window
+    int trace;              // CORX_DISK_TRACE=1 logs every transfer to stdout
+} DiskOptions;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readahead;         // Blocks loaded ahead of a sequential miss
+    uint64_t writebacks;        // Dirty pages written
+    uint64_t writeback_batches;
+    uint64_t bypassed;          // Blocks moved directly between image and caller, skipping the cache
+} DiskCacheStats;
+
+typedef enum {
+    DISK_OP_READ,           // Raw, sector and async reads
+    DISK_OP_WRITE,
+    DISK_OP_FILE_READ,
+    DISK_OP_FILE_WRITE,
+    DISK_OP_FLUSH,
+    DISK_OP_COMMIT,         // Journal write + fdatasync
+    DISK_OP_COUNT
+} DiskOp;
+
+#define DISK_HIST_SUB_BITS 3
+#define DISK_HIST_BUCKETS (64 << DISK_HIST_SUB_BITS)
+
+// HDR-style latency histogram in nanoseconds (log-linear buckets, <= 12.5% error).
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[DISK_HIST_BUCKETS];
+} DiskHistogram;
+
+typedef struct {
+    uint64_t reads, writes;     // Completed operations, raw and file
+    uint64_t read_bytes, write_bytes;
+    uint64_t flushes;
+    uint64_t syscalls;          // Image and journal I/O, sync and truncate calls
+    uint64_t journal_commits;
+    uint64_t journal_bytes;
+    DiskCacheStats cache;
+    DiskHistogram latency[DISK_OP_COUNT];
+} DiskMetrics;
+
+// File system usage, for diskutil.
+typedef struct {
+    uint32_t block_size;
+    uint32_t total_blocks;
+    uint32_t free_blocks;
+    uint32_t files;
+    uint32_t extents;           // Over all files; equals files when none is fragmented
+    uint32_t largest_free;      // Longest run of free blocks
+    uint32_t overlay_blocks;    // Blocks written through an overlay, 0 for plain images
+} DiskFsInfo;
+
+uint64_t disk_parse_size(const char* s);
+void disk_default_options(DiskOptions* opts);
+int disk_create_image(const char* path, uint64_t size, const char* template_path, int preallocate);
+int disk_create_overlay(const char* path, const char* base_path);
+int disk_overlay_base(const char* path, char* base_path, size_t cap);
 Disk* disk_init(void);
+Disk* disk_open(const DiskOptions* opts);
 void disk_cleanup(Disk* disk);
+uint64_t disk_size(Disk* disk);
+void disk_flush(Disk* disk);
+void disk_cache_stats(Disk* disk, DiskCacheStats* stats);
+void disk_metrics(Disk* disk, DiskMetrics* metrics);
+uint64_t disk_histogram_quantile(const DiskHistogram* h, double q);
+void disk_dump_metrics(Disk* disk, FILE* out);
+void disk_metrics_signal(int sig);
+void disk_service_metrics(Disk* disk);
 int disk_read(Disk* disk, uint32_t addr, size_t len, uint8_t* data);
 int disk_write(Disk* disk, uint32_t addr, size_t len, const uint8_t* data);
+int disk_write_sectors(Disk* disk, uint32_t addr, size_t len, const uint8_t* data);
 uint16_t disk_status(Disk* disk);
+uint16_t disk_submit(Disk* disk, int write, uint32_t addr, size_t len, uint8_t* data);
+int disk_poll(Disk* disk, uint16_t* id, uint16_t* status);
+unsigned disk_completed(Disk* disk);
+void disk_cancel_requests(Disk* disk);
 int disk_create_file(Disk* disk, const char* filename);
 int disk_delete_file(Disk* disk, const char* filename);
+int disk_file_read(Disk* disk, const char* filename, uint32_t offset, size_t len, uint8_t* data, size_t* done);
+int disk_file_write(Disk* disk, const char* filename, uint32_t offset, size_t len, const uint8_t* data);
+int disk_file_size(Disk* disk, const char* filename, uint32_t* size);
+int disk_compact(Disk* disk);
+int disk_commit_overlay(Disk* disk);
+void disk_fs_info(Disk* disk, DiskFsInfo* info);
 
 #endif
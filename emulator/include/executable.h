@@ -0,0 +1,34 @@
+#ifndef EXECUTABLE_H
+#define EXECUTABLE_H
+#include <stdint.h>
+
+// Executables written by the assembler and the linker. All fields are
+// little-endian. Layout:
+//   ExeHeader
+//   ExeSegment[nsegments]
+//   segment bytes, in table order
+// The loader zeroes the BSS range, copies each segment to its address and
+// starts at entry. Files without the magic are loaded as flat images at 0.
+
+#define EXE_MAGIC 0x31455843    // "CXE1"
+#define EXE_VERSION 1
+#define EXE_MAX_SEGMENTS 16
+
+#define EXE_TEXT 0x1            // ExeSegment.flags: the segment holds code
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t nsegments;
+    uint32_t entry;             // Byte address of the first instruction
+    uint32_t bss_base;          // Byte range zeroed before the segments are copied
+    uint32_t bss_size;
+} ExeHeader;
+
+typedef struct {
+    uint32_t addr;              // Load address in bytes
+    uint32_t size;              // Bytes in the file
+    uint32_t flags;
+} ExeSegment;
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef HOSTFS_H
+#define HOSTFS_H
+#include <stdint.h>
+#include <stddef.h>
+
+#define HOSTFS_DIR "share"              // Default host directory, CORX_HOSTFS_DIR overrides
+#define HOSTFS_MAX_HANDLES 16
+#define HOSTFS_NAME_MAX 64              // Guest-visible name length, including the NUL
+#define HOSTFS_BUFFER_SIZE 4096         // Initial per-handle buffer and readahead window
+#define HOSTFS_MAX_READAHEAD 0x40000    // Readahead window cap, 256 KB
+
+// Open flags (INT 12 function 0x01, CX)
+#define HOSTFS_READ 0x01
+#define HOSTFS_WRITE 0x02
+#define HOSTFS_CREATE 0x04              // Create the file if missing
+#define HOSTFS_TRUNCATE 0x08
+#define HOSTFS_APPEND 0x10              // Start at the end of the file
+#define HOSTFS_EXCL 0x20                // With CREATE: fail if the file exists
+
+enum { HOSTFS_SEEK_SET, HOSTFS_SEEK_CUR, HOSTFS_SEEK_END };
+
+// Status codes; 1, 3 and 5 match the disk's
+enum {
+    HOSTFS_OK = 0,
+    HOSTFS_EIO = 1,
+    HOSTFS_ENOENT = 3,
+    HOSTFS_EEXIST = 5,
+    HOSTFS_EBADF = 6,                   // Not an open handle, or opened without the needed access
+    HOSTFS_EMFILE = 7,                  // All handles in use
+    HOSTFS_EINVAL = 8,                  // Bad name, flags or seek
+};
+
+typedef struct HostFs HostFs;
+
+HostFs* hostfs_init(const char* dir);
+void hostfs_cleanup(HostFs* fs);
+int hostfs_status(HostFs* fs);
+int hostfs_open(HostFs* fs, const char* name, int flags);
+int hostfs_close(HostFs* fs, int handle);
+long hostfs_read(HostFs* fs, int handle, uint8_t* data, size_t len);
+long hostfs_write(HostFs* fs, int handle, const uint8_t* data, size_t len);
+int64_t hostfs_seek(HostFs* fs, int handle, int64_t offset, int whence);
+int hostfs_readdir(HostFs* fs, int index, char* name, size_t cap, uint64_t* size);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct Library Library;
+
+Library* library_init(const char* dir);
+void library_cleanup(Library* lib);
+int library_poll(Library* lib);
+unsigned library_generation(Library* lib);
+int library_count(Library* lib);
+const char* library_name(Library* lib, int index);
+const uint8_t* library_image(Library* lib, const char* name, size_t* size);
+
+#endif
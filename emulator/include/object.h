@@ -0,0 +1,50 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+#include <stdint.h>
+
+// Relocatable object files written by `assembler -c` and combined by `linker`.
+// All fields are little-endian. Layout:
+//   ObjHeader
+//   text: text_words 16-bit words, assembled for address text_base
+//   data: data_size bytes, assembled for address data_base
+//   ObjSymbol[nsyms]
+//   ObjReloc[nrelocs]
+//   string table, strtab_size bytes of NUL-terminated names
+
+#define OBJ_MAGIC 0x314F5843    // "CXO1"
+#define OBJ_VERSION 1
+#define OBJ_DATA_ALIGN 4        // Data sections are placed at multiples of this
+
+enum { OBJ_UNDEF, OBJ_TEXT, OBJ_DATA, OBJ_ABS };    // ObjSymbol.section; OBJ_ABS: equ constant
+enum { OBJ_LOCAL, OBJ_GLOBAL };             // ObjSymbol.bind
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint32_t text_base;         // .org of the source, 0 if it had none
+    uint32_t text_words;
+    uint32_t data_base;
+    uint32_t data_size;
+    uint32_t nsyms;
+    uint32_t nrelocs;
+    uint32_t strtab_size;
+} ObjHeader;
+
+typedef struct {
+    uint32_t name;              // Offset into the string table
+    uint32_t value;             // Offset into its section, the value for OBJ_ABS, 0 for imports
+    uint8_t section;
+    uint8_t bind;
+    uint16_t reserved;
+} ObjSymbol;
+
+// The text word at `word` holds the address of symbol `sym` plus `addend`
+// ("label+4" gives addend 4).
+typedef struct {
+    uint32_t word;
+    uint32_t sym;
+    int32_t addend;
+} ObjReloc;
+
+#endif
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// Merges an emulator profile (CORX_PROFILE) with the assembler's .dbg sidecar
+// (assembler -g) into per-label totals and an annotated source listing.
+
+#define MAX_WORDS 0x8000           // 64K bytes of word addresses
+
+typedef struct { uint32_t addr; int line; } LineEnt;
+typedef struct { uint32_t addr; char* name; uint64_t count; } Label;
+
+static uint64_t counts[MAX_WORDS];
+
+static char* read_file(const char* path, size_t* len) {
+    FILE* in = fopen(path, "rb");
+    if (!in) return NULL;
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    rewind(in);
+    char* buf = (char*)malloc((size_t)(size < 0 ? 0 : size) + 1);
+    if (!buf || size < 0 || fread(buf, 1, (size_t)size, in) != (size_t)size) {
+        fclose(in);
+        free(buf);
+        return NULL;
+    }
+    fclose(in);
+    buf[size] = 0;
+    *len = (size_t)size;
+    return buf;
+}
+
+static int label_cmp(const void* a, const void* b) {
+    uint32_t x = ((const Label*)a)->addr, y = ((const Label*)b)->addr;
+    return x < y ? -1 : x > y;
+}
+
+static int count_cmp(const void* a, const void* b) {
+    uint64_t x = ((const Label*)a)->count, y = ((const Label*)b)->count;
+    return x > y ? -1 : x < y;
+}
+
+// Last label at or before addr, or -1.
+static int label_at(Label* labels, int n, uint32_t addr) {
+    int lo = 0, hi = n - 1, found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (labels[mid].addr <= addr) { found = mid; lo = mid + 1; }
+        else hi = mid - 1;
+    }
+    return found;
+}
+
+static double pct(uint64_t part, uint64_t total) { return total ? 100.0 * (double)part / (double)total : 0.0; }
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <program.dbg> <profile>\n", argv[0]);
+        fprintf(stderr, "  program.dbg: written by assembler -g\n");
+        fprintf(stderr, "  profile: written by the emulator when CORX_PROFILE is set\n");
+        return 1;
+    }
+
+    // Profile: "# comment" and "address count" lines
+    FILE* prof = fopen(argv[2], "r");
+    if (!prof) { fprintf(stderr, "Cannot open %s\n", argv[2]); return 1; }
+    char buf[1024];
+    uint64_t total = 0;
+    while (fgets(buf, sizeof(buf), prof)) {
+        if (buf[0] == '#' || buf[0] == '\n') continue;
+        char* end;
+        unsigned long addr = strtoul(buf, &end, 0);
+        unsigned long long n = strtoull(end, &end, 10);
+        if (addr / 2 >= MAX_WORDS) { fprintf(stderr, "%s: bad line '%s'\n", argv[2], buf); fclose(prof); return 1; }
+        counts[addr / 2] += n;
+        total += n;
+    }
+    fclose(prof);
+
+    // Sidecar
+    FILE* dbg = fopen(argv[1], "r");
+    if (!dbg) { fprintf(stderr, "Cannot open %s\n", argv[1]); return 1; }
+    char source[1024] = "";
+    LineEnt* lines = NULL;
+    Label* labels = NULL;
+    int nlines = 0, lines_cap = 0, nlabels = 0, labels_cap = 0;
+    if (!fgets(buf, sizeof(buf), dbg) || strncmp(buf, "CXDBG 1", 7) != 0) {
+        fprintf(stderr, "%s: not a debug file\n", argv[1]);
+        fclose(dbg);
+        return 1;
+    }
+    while (fgets(buf, sizeof(buf), dbg)) {
+        buf[strcspn(buf, "\r\n")] = 0;
+        unsigned addr;
+        int line, off;
+        char kind;
+        if (strncmp(buf, "file ", 5) == 0) {
+            snprintf(source, sizeof(source), "%s", buf + 5);
+        } else if (sscanf(buf, "line %x %d", &addr, &line) == 2) {
+            if (nlines == lines_cap) {
+                lines_cap = lines_cap ? lines_cap * 2 : 1024;
+                lines = (LineEnt*)realloc(lines, (size_t)lines_cap * sizeof(LineEnt));
+                if (!lines) { fprintf(stderr, "FATAL: out of memory\n"); return 2; }
+            }
+            lines[nlines++] = (LineEnt){ addr, line };
+        } else if (sscanf(buf, "sym %x %c %n", &addr, &kind, &off) == 2 && kind == 'T') {
+            if (nlabels == labels_cap) {
+                labels_cap = labels_cap ? labels_cap * 2 : 256;
+                labels = (Label*)realloc(labels, (size_t)labels_cap * sizeof(Label));
+                if (!labels) { fprintf(stderr, "FATAL: out of memory\n"); return 2; }
+            }
+            labels[nlabels++] = (Label){ addr, strdup(buf + off), 0 };
+        }
+    }
+    fclose(dbg);
+    if (labels) qsort(labels, (size_t)nlabels, sizeof(Label), label_cmp);
+
+    size_t srclen;
+    char* src = read_file(source, &srclen);
+    if (!src) { fprintf(stderr, "Cannot open source %s (named in %s)\n", source, argv[1]); return 1; }
+    int nsrc = 1;
+    for (size_t i = 0; i < srclen; i++) if (src[i] == '\n') nsrc++;
+    char** text = (char**)malloc((size_t)nsrc * sizeof(char*));
+    uint64_t* line_count = (uint64_t*)calloc((size_t)nsrc + 1, sizeof(uint64_t));
+    char* has_code = (char*)calloc((size_t)nsrc + 1, 1);
+    if (!text || !line_count || !has_code) { fprintf(stderr, "FATAL: out of memory\n"); return 2; }
+    nsrc = 0;
+    for (char* s = src; s; ) {
+        text[nsrc++] = s;
+        s = strchr(s, '\n');
+        if (s) *s++ = 0;
+    }
+    for (int i = 0; i < nsrc; i++) text[i][strcspn(text[i], "\r")] = 0;
+
+    uint64_t mapped = 0, unlabeled = 0;
+    for (int i = 0; i < nlines; i++) {
+        uint64_t n = counts[(lines[i].addr / 2) % MAX_WORDS];
+        mapped += n;
+        if (lines[i].line >= 1 && lines[i].line <= nsrc) {
+            line_count[lines[i].line] += n;
+            has_code[lines[i].line] = 1;
+        }
+        int l = label_at(labels, nlabels, lines[i].addr);
+        if (l >= 0) labels[l].count += n;
+        else unlabeled += n;
+    }
+
+    printf("Profile: %llu instruction(s) executed, %llu (%.1f%%) in %s\n\n",
+           (unsigned long long)total, (unsigned long long)mapped, pct(mapped, total), source);
+
+    if (labels) qsort(labels, (size_t)nlabels, sizeof(Label), count_cmp);
+    printf("%12s %7s  %s\n", "count", "%", "label");
+    for (int i = 0; i < nlabels && labels[i].count; i++) {
+        printf("%12llu %6.2f%%  %s\n", (unsigned long long)labels[i].count, pct(labels[i].count, total), labels[i].name);
+    }
+    if (unlabeled) printf("%12llu %6.2f%%  (before the first label)\n", (unsigned long long)unlabeled, pct(unlabeled, total));
+    if (total > mapped) printf("%12llu %6.2f%%  (outside %s)\n", (unsigned long long)(total - mapped), pct(total - mapped, total), source);
+
+    // Code lines that never ran show 0; lines without code are left blank.
+    printf("\n%12s %7s  %5s  %s\n", "count", "%", "line", source);
+    for (int i = 1; i <= nsrc; i++) {
+        if (has_code[i]) printf("%12llu %6.2f%%  %5d  %s\n", (unsigned long long)line_count[i], pct(line_count[i], total), i, text[i - 1]);
+        else printf("%12s %7s  %5d  %s\n", "", "", i, text[i - 1]);
+    }
+
+    for (int i = 0; i < nlabels; i++) free(labels[i].name);
+    free(labels);
+    free(lines);
+    free(text);
+    free(line_count);
+    free(has_code);
+    free(src);
+    return 0;
+}
@@ -4,13 +4,16 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "object.h"
+#include "executable.h"
 
-#define MAX_LINE 512
-#define MAX_LABELS 2048
-#define MAX_DATA 4096
 #define MAX_CODE_WORDS 65536
+#define ARENA_BLOCK 65536
 #define FORBID_LO 0xFF00
 #define FORBID_HI 0xFFFF
+#define DATA_BASE 0x0100   // Default data segment base address
 
 // ---------- utils ----------
 static char* rstrip(char* s) {
@@ -28,47 +31,173 @@ static void lower(char* s) { for (; *s; s++) *s = (char)tolower((unsigned char)*
 
 static int is_ident_char(int c) { return isalnum(c) || c == '_' || c == '.'; }
 
-// ---------- error handling ----------
+// ---------- assembler state ----------
+// Everything one assembly needs lives in an Asm, so batch mode can run several
+// on different threads.
 typedef struct { int line; char* msg; } Err;
-static Err* errs = NULL;
-static size_t nerrs = 0;
+typedef struct ArenaBlock { struct ArenaBlock* next; size_t used, cap; } ArenaBlock;
+enum { SYM_GLOBAL = 1, SYM_EXTERN = 2 };   // Symbol.flags, for object output
+typedef struct {
+    const char* name;
+    uint32_t hash;
+    uint32_t addr;
+    int data;                   // Data item index or -1
+    int flags;
+    int stmt;                   // Code labels: index of the statement they precede, else -1
+    const char* equ;            // equ constants: the expression, evaluated on use
+} Symbol;
+typedef enum { DT_DB = 1, DT_DW = 2, DT_DD = 4 } DType;
+typedef struct { const char* name; DType type; uint32_t addr; size_t count; uint8_t* raw; int reserved; } DataItem;  // reserved: resb/resw/resd, zeroed at load
+typedef struct { const char* name; int line; } Global;     // .global name, checked once every label is defined
+typedef struct { uint16_t words[2]; int nwords; } Enc;
+typedef struct {
+    Enc enc;
+    const char* sym;            // Symbol operand, patched in the second pass
+    int line;
+    int target;                 // A label points here
+    uint32_t addr;              // Set by layout()
+} Stmt;
+
+typedef struct {
+    const char* name;           // Input path, prefixed to diagnostics in batch mode; NULL otherwise
+    FILE* err;                  // Diagnostics
+    FILE* msg;                  // Summary line
+
+    Err* errs;
+    size_t nerrs;
+    ArenaBlock* arena;
+
+    // Labels and named data share one open-addressed hash table of indices
+    // into syms, which keeps definition order.
+    Symbol* syms;
+    int nsyms, syms_cap;
+    int* sym_table;             // -1 = empty slot
+    uint32_t sym_mask;          // Table size - 1, a power of two
+
+    DataItem* data_items;
+    int ndata, data_cap;
+    uint32_t data_base;
+    Global* globals;
+    int nglobals, globals_cap;
+
+    Stmt* stmts;
+    int nstmts, stmts_cap;
+    ObjReloc* relocs;
+    int nrelocs, relocs_cap;
+
+    uint16_t code[MAX_CODE_WORDS];
+    size_t code_words;
+    uint32_t org_address;
+    int optimize;               // -O: run the peephole pass
+    int debug;                  // -g: write a .dbg sidecar next to the binary
+    int flat;                   // -f: write a flat image instead of an executable
+} Asm;
 
-static void add_err(int line, const char* fmt, ...) {
+// ---------- error handling ----------
+
+static void add_err(Asm* a, int line, const char* fmt, ...) {
     va_list ap; va_start(ap, fmt);
     char buf[512]; vsnprintf(buf, sizeof(buf), fmt, ap); va_end(ap);
-    errs = (Err*)realloc(errs, (nerrs + 1) * sizeof(Err));
-    errs[nerrs].line = line; errs[nerrs].msg = strdup(buf); nerrs++;
+    a->errs = (Err*)realloc(a->errs, (a->nerrs + 1) * sizeof(Err));
+    a->errs[a->nerrs].line = line; a->errs[a->nerrs].msg = strdup(buf); a->nerrs++;
+}
+
+static int has_errors(Asm* a) { return (int)a->nerrs; }
+
+static void flush_errors(Asm* a) {
+    for (size_t i = 0; i < a->nerrs; i++) {
+        if (a->name) fprintf(a->err, "%s: ", a->name);
+        fprintf(a->err, "Error [line %d]: %s\n", a->errs[i].line, a->errs[i].msg);
+        free(a->errs[i].msg);
+    }
+    free(a->errs); a->errs = NULL; a->nerrs = 0;
+}
+
+// ---------- arena ----------
+// Symbol names and data bytes live until exit, so they are bump-allocated
+// from large blocks and released all at once.
+
+static void* arena_alloc(Asm* a, size_t n) {
+    n = (n + 7) & ~(size_t)7;
+    if (!a->arena || a->arena->cap - a->arena->used < n) {
+        size_t cap = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+        ArenaBlock* b = (ArenaBlock*)malloc(sizeof(ArenaBlock) + cap);
+        if (!b) { fprintf(stderr, "FATAL: out of memory\n"); exit(2); }
+        b->next = a->arena; b->used = 0; b->cap = cap;
+        a->arena = b;
+    }
+    void* p = (uint8_t*)(a->arena + 1) + a->arena->used;
+    a->arena->used += n;
+    return p;
 }
 
-static int has_errors(void) { return (int)nerrs; }
+static char* arena_strdup(Asm* a, const char* s) {
+    size_t n = strlen(s) + 1;
+    return (char*)memcpy(arena_alloc(a, n), s, n);
+}
 
-static void flush_errors(void) {
-    for (size_t i = 0; i < nerrs; i++) { fprintf(stderr, "Error [line %d]: %s\n", errs[i].line, errs[i].msg); free(errs[i].msg); }
-    free(errs); errs = NULL; nerrs = 0;
+static void arena_free(Asm* a) {
+    while (a->arena) { ArenaBlock* next = a->arena->next; free(a->arena); a->arena = next; }
 }
 
 // ---------- symbols / data ----------
-typedef struct { char* name; uint32_t addr; } Label;
-static Label labels[MAX_LABELS];
-static int nlabels = 0;
 
-static int add_label(const char* name, uint32_t addr) {
-    if (nlabels >= MAX_LABELS) return -1;
-    labels[nlabels].name = strdup(name);
-    labels[nlabels].addr = addr;
-    return nlabels++;
+static uint32_t hash_name(const char* s) {
+    uint32_t h = 2166136261u;       // FNV-1a
+    for (; *s; s++) h = (h ^ (uint8_t)*s) * 16777619u;
+    return h;
 }
 
-static int find_label(const char* name) {
-    for (int i = 0; i < nlabels; i++) if (strcmp(labels[i].name, name) == 0) return i;
+static int find_sym(Asm* a, const char* name) {
+    if (!a->sym_table) return -1;
+    uint32_t h = hash_name(name);
+    for (uint32_t i = h & a->sym_mask; a->sym_table[i] >= 0; i = (i + 1) & a->sym_mask) {
+        Symbol* sym = &a->syms[a->sym_table[i]];
+        if (sym->hash == h && strcmp(sym->name, name) == 0) return a->sym_table[i];
+    }
     return -1;
 }
 
-typedef enum { DT_DB = 1, DT_DW = 2, DT_DD = 4 } DType;
-typedef struct { char* name; DType type; uint32_t addr; size_t count; uint8_t* raw; } DataItem;
-static DataItem data_items[MAX_DATA];
-static int ndata = 0;
-static uint32_t data_base = 0x0100; // Default data segment base address
+static void sym_rehash(Asm* a, uint32_t size) {
+    free(a->sym_table);
+    a->sym_table = (int*)malloc(size * sizeof(int));
+    if (!a->sym_table) { fprintf(stderr, "FATAL: out of memory\n"); exit(2); }
+    memset(a->sym_table, 0xFF, size * sizeof(int));
+    a->sym_mask = size - 1;
+    for (int k = 0; k < a->nsyms; k++) {
+        uint32_t i = a->syms[k].hash & a->sym_mask;
+        while (a->sym_table[i] >= 0) i = (i + 1) & a->sym_mask;
+        a->sym_table[i] = k;
+    }
+}
+
+// Adds a symbol the caller has checked is not defined yet.
+static int add_sym(Asm* a, const char* name, uint32_t addr, int data) {
+    if (a->nsyms == a->syms_cap) {
+        a->syms_cap = a->syms_cap ? a->syms_cap * 2 : 256;
+        a->syms = (Symbol*)realloc(a->syms, (size_t)a->syms_cap * sizeof(Symbol));
+        if (!a->syms) { fprintf(stderr, "FATAL: out of memory\n"); exit(2); }
+    }
+    a->syms[a->nsyms] = (Symbol){ arena_strdup(a, name), hash_name(name), addr, data, 0, -1, NULL };
+    a->nsyms++;
+    if (!a->sym_table || (uint32_t)a->nsyms * 4 > (a->sym_mask + 1) * 3) {   // Keep the load under 3/4
+        sym_rehash(a, a->sym_table ? (a->sym_mask + 1) * 2 : 512);
+    } else {
+        uint32_t i = a->syms[a->nsyms - 1].hash & a->sym_mask;
+        while (a->sym_table[i] >= 0) i = (i + 1) & a->sym_mask;
+        a->sym_table[i] = a->nsyms - 1;
+    }
+    return a->nsyms - 1;
+}
+
+static void add_label(Asm* a, int line, const char* name, uint32_t addr) {
+    if (find_sym(a, name) >= 0) add_err(a, line, "duplicate label '%s'", name);
+    else {
+        int si = add_sym(a, name, addr, -1);
+        a->syms[si].stmt = a->nstmts;
+    }
+}
+
 
 // ---------- registers ----------
 typedef struct { const char* name; uint8_t id; } Reg;
@@ -92,7 +221,8 @@ static Op ops[] = {
     {"push", 16, 1}, {"pop", 17, 1}, {"pusha", 18, 0}, {"popa", 19, 0},
     {"int", 20, 1},
     {"jmp", 21, 1}, {"call", 22, 1}, {"ret", 23, 0},
-    {"jz", 24, 1}, {"jnz", 25, 1}, {"jg", 26, 1}, {"jl", 27, 1}
+    {"jz", 24, 1}, {"jnz", 25, 1}, {"jg", 26, 1}, {"jl", 27, 1},
+    {"iret", 30, 0}
 };
 
 typedef struct { const char* alias; const char* canon; } Alias;
@@ -110,8 +240,12 @@ static int find_op(const char* mnem, Op* out) {
 
 // ---------- encoding ----------
 // word0: [5b opcode][3b r1][3b r2][5b mode]
-// mode: 0=none, 1=reg, 2=reg_reg, 3=reg_imm16, 4=reg_mem16, 5=imm16 only, 6=mem16 only
-typedef struct { uint16_t words[2]; int nwords; } Enc;
+// mode: 0=none, 1=reg, 2=reg_reg, 3=reg_imm16, 4=reg_mem16, 5=imm16 only,
+//       6=reg <- [mem16] (op 28), 7=[mem16] <- reg (op 29)
+// One-word forms: 16-23=reg_imm6, imm in r2:mode[2:0]; 24-31=short branch,
+//       signed word offset from the next instruction in r1:r2:mode[2:0]
+#define MODE_SHORT_IMM 16
+#define MODE_SHORT_BRANCH 24
 
 static Enc enc_rr(uint8_t op, uint8_t r1, uint8_t r2) {
     Enc e = {{0}, 1};
@@ -132,6 +266,22 @@ static Enc enc_r_imm(uint8_t op, uint8_t r1, uint16_t imm) {
     return e;
 }
 
+static int fits_short_imm(uint16_t imm) { return imm <= 31 || imm >= 0xFFE0; }
+
+static Enc enc_r_simm(uint8_t op, uint8_t r1, uint16_t imm) {
+    Enc e = {{0}, 1};
+    e.words[0] = (uint16_t)((op << 11) | ((r1 & 7) << 8) | (((imm >> 3) & 7) << 5) | MODE_SHORT_IMM | (imm & 7));
+    return e;
+}
+
+static int fits_short_branch(int32_t off) { return off >= -256 && off <= 255; }
+
+static Enc enc_short_branch(uint8_t op, int32_t off) {
+    Enc e = {{0}, 1};
+    e.words[0] = (uint16_t)((op << 11) | ((((uint32_t)off >> 3) & 0x3F) << 5) | MODE_SHORT_BRANCH | (off & 7));
+    return e;
+}
+
 static Enc enc_r_mem(uint8_t op, uint8_t r1, uint16_t addr) {
     Enc e = {{0}, 2};
     e.words[0] = (uint16_t)((op << 11) | ((r1 & 7) << 8) | 4);
@@ -139,6 +289,20 @@ static Enc enc_r_mem(uint8_t op, uint8_t r1, uint16_t addr) {
     return e;
 }
 
+static Enc enc_r_load(uint8_t r1, uint16_t addr) {
+    Enc e = {{0}, 2};
+    e.words[0] = (uint16_t)((28 << 11) | ((r1 & 7) << 8) | 6);
+    e.words[1] = addr;
+    return e;
+}
+
+static Enc enc_r_store(uint8_t r1, uint16_t addr) {
+    Enc e = {{0}, 2};
+    e.words[0] = (uint16_t)((29 << 11) | ((r1 & 7) << 8) | 7);
+    e.words[1] = addr;
+    return e;
+}
+
 static Enc enc_imm(uint8_t op, uint16_t imm) {
     Enc e = {{0}, 2};
     e.words[0] = (uint16_t)((op << 11) | 5);
@@ -165,32 +329,261 @@ static int parse_number(const char* s, uint32_t* out) {
     }
 }
 
-// ---------- tokenizer for args ----------
-static void trim_comm(char* s) { char* sc = strchr(s, ';'); if (sc) *sc = 0; rstrip(s); }
+// ---------- expressions ----------
+// Operands, data values, .org and equ take constant expressions: numbers,
+// labels, equ names, $ (address of the current instruction), sizeof(data),
+// parentheses, unary - ~ and + - * / % << >> & | with C precedence.
+// Label addresses are final only after layout, so the first pass folds what
+// it can and the second pass evaluates the rest. In object files the result
+// may be an address plus a constant, which becomes a relocation addend.
 
-static void split_args(char* s, char* a1, char* a2) {
-    a1[0] = a2[0] = 0;
-    char* comma = strchr(s, ',');
-    if (!comma) { strncpy(a1, lskip(s), 128 - 1); rstrip(a1); return; }
-    *comma = 0;
-    strncpy(a1, lskip(s), 128 - 1); rstrip(a1);
-    strncpy(a2, lskip(comma + 1), 128 - 1); rstrip(a2);
+enum { SEC_ABS, SEC_TEXT, SEC_DATA, SEC_EXTERN };
+#define HERE_LATER (-1)         // $ is known in the second pass
+#define HERE_NONE (-2)          // $ is not allowed here
+
+typedef struct { int64_t v; int sect; int sym; } Val;     // sym: relocation base or -1
+
+typedef struct {
+    Asm* a;
+    const char* start;
+    const char* p;
+    int line;
+    int final;                  // Labels have their final addresses
+    int object;                 // Track sections for relocations
+    int64_t here;               // Value of $, or HERE_*
+    int depth;                  // equ nesting
+    int deferred;               // Needs a label address that is not final yet
+    int failed;
+} Expr;
+
+static Val ex_or(Expr* e);
+
+static void ex_skip(Expr* e) { while (*e->p == ' ' || *e->p == '\t') e->p++; }
+
+static Val ex_fail(Expr* e, const char* fmt, const char* arg) {
+    if (!e->failed) add_err(e->a, e->line, fmt, arg);
+    e->failed = 1;
+    return (Val){0, SEC_ABS, -1};
 }
 
-static void clean_ident(char* s) {
-    char* p = lskip(s); memmove(s, p, strlen(p) + 1); rstrip(s);
+// Reads an identifier into buf; returns 0 if there is none or it is too long.
+static int ex_ident(Expr* e, char* buf, size_t cap) {
+    size_t n = 0;
+    ex_skip(e);
+    if (!is_ident_char((unsigned char)*e->p) || isdigit((unsigned char)*e->p)) return 0;
+    while (is_ident_char((unsigned char)*e->p)) {
+        if (n + 1 >= cap) return 0;
+        buf[n++] = *e->p++;
+    }
+    buf[n] = 0;
+    return 1;
+}
+
+static Val ex_symbol(Expr* e, const char* name) {
+    Val r = {0, SEC_ABS, -1};
+    int si = find_sym(e->a, name);
+    if (si < 0) {
+        if (!e->final) { e->deferred = 1; return r; }
+        return ex_fail(e, "undefined symbol '%s'", name);
+    }
+    Symbol* sym = &e->a->syms[si];
+    if (sym->equ) {
+        if (e->depth >= 16) return ex_fail(e, "equ '%s' refers to itself", name);
+        const char* p = e->p;
+        int64_t here = e->here;
+        e->p = sym->equ;
+        e->here = HERE_NONE;
+        e->depth++;
+        r = ex_or(e);
+        e->depth--;
+        e->p = p;
+        e->here = here;
+        return r;
+    }
+    if (!e->final) { e->deferred = 1; return r; }
+    if (sym->flags & SYM_EXTERN) {
+        if (!e->object) return ex_fail(e, "'%s' is external; assemble with -c and link", name);
+        return (Val){0, SEC_EXTERN, si};
+    }
+    r.v = sym->addr;
+    if (e->object) { r.sect = sym->data >= 0 ? SEC_DATA : SEC_TEXT; r.sym = si; }
+    return r;
+}
+
+static Val ex_sizeof(Expr* e) {
+    char name[256];
+    ex_skip(e);
+    if (*e->p++ != '(' || !ex_ident(e, name, sizeof(name))) return ex_fail(e, "sizeof needs a data name in '%s'", e->start);
+    ex_skip(e);
+    if (*e->p++ != ')') return ex_fail(e, "missing ')' in '%s'", e->start);
+    int si = find_sym(e->a, name);
+    if (si < 0) {
+        if (!e->final) { e->deferred = 1; return (Val){0, SEC_ABS, -1}; }
+        return ex_fail(e, "undefined symbol '%s'", name);
+    }
+    if (e->a->syms[si].data < 0) return ex_fail(e, "sizeof: '%s' is not a data item", name);
+    return (Val){(int64_t)e->a->data_items[e->a->syms[si].data].count, SEC_ABS, -1};
+}
+
+static Val ex_primary(Expr* e) {
+    Val r = {0, SEC_ABS, -1};
+    ex_skip(e);
+    char c = *e->p;
+    if (c == '(') {
+        e->p++;
+        r = ex_or(e);
+        ex_skip(e);
+        if (*e->p != ')') return ex_fail(e, "missing ')' in '%s'", e->start);
+        e->p++;
+        return r;
+    }
+    if (c == '-' || c == '~' || c == '+') {
+        e->p++;
+        r = ex_primary(e);
+        if (c == '+') return r;
+        if (r.sect != SEC_ABS) return ex_fail(e, "cannot negate an address in '%s'", e->start);
+        r.v = c == '-' ? -r.v : ~r.v;
+        return r;
+    }
+    if (c == '$') {
+        e->p++;
+        if (e->here == HERE_NONE) return ex_fail(e, "'$' is only allowed in instructions ('%s')", e->start);
+        if (e->here == HERE_LATER) { e->deferred = 1; return r; }
+        r.v = e->here;
+        if (e->object) r.sect = SEC_TEXT;
+        return r;
+    }
+    if (isdigit((unsigned char)c)) {
+        char num[64];
+        size_t n = 0;
+        while (isalnum((unsigned char)*e->p) && n + 1 < sizeof(num)) num[n++] = *e->p++;
+        num[n] = 0;
+        uint32_t v;
+        if (!parse_number(num, &v)) return ex_fail(e, "bad number '%s'", num);
+        r.v = v;
+        return r;
+    }
+    char name[256];
+    if (!ex_ident(e, name, sizeof(name))) {
+        return ex_fail(e, *e->p ? "bad expression '%s'" : "missing operand in '%s'", e->start);
+    }
+    if (strcasecmp(name, "sizeof") == 0) {
+        ex_skip(e);
+        if (*e->p == '(') return ex_sizeof(e);
+    }
+    return ex_symbol(e, name);
+}
+
+static Val ex_apply(Expr* e, char op, Val x, Val y) {
+    if (e->failed || e->deferred) return x;
+    if (op == '+') {
+        if (x.sect != SEC_ABS && y.sect != SEC_ABS) return ex_fail(e, "cannot add two addresses in '%s'", e->start);
+        Val r = x.sect != SEC_ABS ? x : y;
+        r.v = x.v + y.v;
+        return r;
+    }
+    if (op == '-') {
+        if (y.sect == SEC_ABS) { x.v -= y.v; return x; }
+        if (x.sect == y.sect && x.sect != SEC_EXTERN) return (Val){x.v - y.v, SEC_ABS, -1};
+        return ex_fail(e, "cannot subtract addresses from different sections in '%s'", e->start);
+    }
+    if (x.sect != SEC_ABS || y.sect != SEC_ABS) {
+        return ex_fail(e, "'%s' cannot be relocated; only address +/- constant can", e->start);
+    }
+    switch (op) {
+        case '*': x.v *= y.v; break;
+        case '/':
+        case '%':
+            if (y.v == 0) return ex_fail(e, "division by zero in '%s'", e->start);
+            x.v = op == '/' ? x.v / y.v : x.v % y.v;
+            break;
+        case '<': x.v = y.v < 0 || y.v > 63 ? 0 : (int64_t)((uint64_t)x.v << y.v); break;
+        case '>': x.v = y.v < 0 || y.v > 63 ? 0 : x.v >> y.v; break;
+        case '&': x.v &= y.v; break;
+        case '|': x.v |= y.v; break;
+    }
+    return x;
+}
+
+static Val ex_mul(Expr* e) {
+    Val x = ex_primary(e);
+    for (;;) {
+        ex_skip(e);
+        char op = *e->p;
+        if (op != '*' && op != '/' && op != '%') return x;
+        e->p++;
+        x = ex_apply(e, op, x, ex_primary(e));
+    }
+}
+
+static Val ex_add(Expr* e) {
+    Val x = ex_mul(e);
+    for (;;) {
+        ex_skip(e);
+        char op = *e->p;
+        if (op != '+' && op != '-') return x;
+        e->p++;
+        x = ex_apply(e, op, x, ex_mul(e));
+    }
+}
+
+static Val ex_shift(Expr* e) {
+    Val x = ex_add(e);
+    for (;;) {
+        ex_skip(e);
+        char op = *e->p;
+        if ((op != '<' && op != '>') || e->p[1] != op) return x;
+        e->p += 2;
+        x = ex_apply(e, op, x, ex_add(e));
+    }
+}
+
+static Val ex_and(Expr* e) {
+    Val x = ex_shift(e);
+    for (;;) {
+        ex_skip(e);
+        if (*e->p != '&') return x;
+        e->p++;
+        x = ex_apply(e, '&', x, ex_shift(e));
+    }
+}
+
+static Val ex_or(Expr* e) {
+    Val x = ex_and(e);
+    for (;;) {
+        ex_skip(e);
+        if (*e->p != '|') return x;
+        e->p++;
+        x = ex_apply(e, '|', x, ex_and(e));
+    }
+}
+
+// Returns 0 with the value in *out, 1 if a label address is needed first
+// (only before the second pass), or -1 after reporting an error.
+static int eval_expr(Asm* a, int line, const char* s, int final, int object, int64_t here, Val* out) {
+    Expr e = { a, s, s, line, final, object, here, 0, 0, 0 };
+    *out = ex_or(&e);
+    ex_skip(&e);
+    if (!e.failed && *e.p) ex_fail(&e, "unexpected characters in '%s'", s);
+    if (e.failed) return -1;
+    return e.deferred ? 1 : 0;
 }
 
 // ---------- .data parsing ----------
-static int emit_scalar(DType t, uint32_t v, uint8_t** out, size_t* len, int line) {
-    if (t == DT_DB && v > 0xFF) {
-        add_err(line, "value 0x%X too large for db (max 0xFF)", v);
+static int emit_scalar(Asm* a, DType t, int64_t value, uint8_t** out, size_t* len, int line) {
+    if (t == DT_DB && (value < -0x80 || value > 0xFF)) {
+        add_err(a, line, "value %lld out of range for db (-128..0xFF)", (long long)value);
         return 0;
     }
-    if (t == DT_DW && v > 0xFFFF) {
-        add_err(line, "value 0x%X too large for dw (max 0xFFFF)", v);
+    if (t == DT_DW && (value < -0x8000 || value > 0xFFFF)) {
+        add_err(a, line, "value %lld out of range for dw (-32768..0xFFFF)", (long long)value);
         return 0;
     }
+    if (t == DT_DD && (value < -0x80000000LL || value > 0xFFFFFFFFLL)) {
+        add_err(a, line, "value %lld out of range for dd", (long long)value);
+        return 0;
+    }
+    uint32_t v = (uint32_t)value;
     if (t == DT_DB) {
         *out = (uint8_t*)realloc(*out, *len + 1);
         (*out)[(*len)++] = (uint8_t)(v & 0xFF);
@@ -210,15 +603,15 @@ static int emit_scalar(DType t, uint32_t v, uint8_t** out, size_t* len, int line
         (*out)[(*len)++] = (uint8_t)((v >> 24) & 0xFF);
         return 1;
     }
-    add_err(line, "invalid data type");
+    add_err(a, line, "invalid data type");
     return 0;
 }
 
-static int parse_string(const char* p, uint8_t** raw, size_t* rawlen, int line) {
+static int parse_string(Asm* a, const char* p, uint8_t** raw, size_t* rawlen, int line) {
     p++; // Skip opening quote
     const char* end = strchr(p, '"');
     if (!end) {
-        add_err(line, "unterminated string");
+        add_err(a, line, "unterminated string");
         return 0;
     }
     size_t len = (size_t)(end - p);
@@ -230,336 +623,890 @@ static int parse_string(const char* p, uint8_t** raw, size_t* rawlen, int line)
     return 1;
 }
 
-static int parse_data_values(int line, DType t, const char* rhs, uint8_t** raw, size_t* rawlen) {
-    const char* p = lskip((char*)rhs);
+static int parse_data_values(Asm* a, int line, DType t, char* rhs, uint8_t** raw, size_t* rawlen) {
+    char* p = lskip(rhs);
     if (*p == '"') {
         if (t != DT_DB) {
-            add_err(line, "strings are only allowed with db");
+            add_err(a, line, "strings are only allowed with db");
             return 0;
         }
-        return parse_string(p, raw, rawlen, line);
+        return parse_string(a, p, raw, rawlen, line);
     }
-    char buf[MAX_LINE];
-    strncpy(buf, p, sizeof(buf) - 1);
-    buf[sizeof(buf) - 1] = 0;
-    char* tok = strtok(buf, ",");
+    char* save;
+    char* tok = strtok_r(p, ",", &save);
     if (!tok) {
-        add_err(line, "empty data list");
+        add_err(a, line, "empty data list");
         return 0;
     }
     while (tok) {
-        char tmp[128];
-        strncpy(tmp, lskip(tok), sizeof(tmp) - 1);
-        tmp[sizeof(tmp) - 1] = 0;
-        rstrip(tmp);
-        uint32_t v;
-        if (!parse_number(tmp, &v)) {
-            add_err(line, "invalid number in data: '%s'", tmp);
+        char* tmp = rstrip(lskip(tok));
+        Val v;
+        int st = eval_expr(a, line, tmp, 0, 0, HERE_NONE, &v);
+        if (st < 0) return 0;
+        if (st > 0) {
+            add_err(a, line, "data values must be constants: '%s'", tmp);
             return 0;
         }
-        if (!emit_scalar(t, v, raw, rawlen, line)) {
+        if (!emit_scalar(a, t, v.v, raw, rawlen, line)) {
             return 0;
         }
-        tok = strtok(NULL, ",");
+        tok = strtok_r(NULL, ",", &save);
     }
     return 1;
 }
 
-static int add_data(int line, const char* name, DType t, const char* rhs) {
-    if (ndata >= MAX_DATA) {
-        add_err(line, "too many data items");
+// "name: db values" stores the values; "name: resb count" (reserved != 0)
+// reserves count zeroed elements that executables leave to the BSS range.
+static int add_data(Asm* a, int line, const char* name, DType t, char* rhs, int reserved) {
+    int prev = name[0] ? find_sym(a, name) : -1;
+    if (prev >= 0) {
+        add_err(a, line, a->syms[prev].data >= 0 ? "duplicate data name '%s'" : "duplicate label '%s'", name);
         return 0;
     }
-    for (int i = 0; i < ndata; i++) {
-        if (strcmp(data_items[i].name, name) == 0) {
-            add_err(line, "duplicate data name '%s'", name);
-            return 0;
-        }
-    }
     // Align dw to 2 bytes, dd to 4 bytes
-    if (t == DT_DW && (data_base & 1)) {
-        data_base = (data_base + 1) & ~1;
-    } else if (t == DT_DD && (data_base & 3)) {
-        data_base = (data_base + 3) & ~3;
+    if (t == DT_DW && (a->data_base & 1)) {
+        a->data_base = (a->data_base + 1) & ~1;
+    } else if (t == DT_DD && (a->data_base & 3)) {
+        a->data_base = (a->data_base + 3) & ~3;
     }
     uint8_t* raw = NULL;
     size_t len = 0;
-    if (!parse_data_values(line, t, rhs, &raw, &len)) {
+    if (reserved) {
+        Val v;
+        int st = eval_expr(a, line, rstrip(lskip(rhs)), 0, 0, HERE_NONE, &v);
+        if (st < 0) return 0;
+        int size = t == DT_DB ? 1 : t == DT_DW ? 2 : 4;
+        if (st > 0 || v.v <= 0 || a->data_base + (uint64_t)v.v * size > 0x10000) {
+            add_err(a, line, "reservation needs a positive constant count that fits in 64K: '%s'", rhs);
+            return 0;
+        }
+        len = (size_t)v.v * size;
+        raw = (uint8_t*)calloc(len, 1);
+        if (!raw) { fprintf(stderr, "FATAL: out of memory\n"); exit(2); }
+    } else if (!parse_data_values(a, line, t, rhs, &raw, &len)) {
         free(raw);
         return 0;
     }
-    data_items[ndata].name = strdup(name[0] ? name : "");
-    data_items[ndata].type = t;
-    data_items[ndata].addr = data_base;
-    data_items[ndata].count = len;
-    data_items[ndata].raw = raw;
-    ndata++;
-    data_base += (uint32_t)len;
-    if (name[0]) {
-        add_label(name, data_items[ndata - 1].addr);
+    if (a->ndata == a->data_cap) {
+        a->data_cap = a->data_cap ? a->data_cap * 2 : 256;
+        a->data_items = (DataItem*)realloc(a->data_items, (size_t)a->data_cap * sizeof(DataItem));
+        if (!a->data_items) { fprintf(stderr, "FATAL: out of memory\n"); exit(2); }
     }
+    DataItem* d = &a->data_items[a->ndata];
+    d->name = name[0] ? arena_strdup(a, name) : "";
+    d->type = t;
+    d->addr = a->data_base;
+    d->count = len;
+    d->raw = (uint8_t*)memcpy(arena_alloc(a, len), raw, len);
+    d->reserved = reserved;
+    free(raw);
+    if (name[0]) add_sym(a, d->name, d->addr, a->ndata);
+    a->ndata++;
+    a->data_base += (uint32_t)len;
     return 1;
 }
 
 // ---------- code buffer ----------
-static uint16_t code[MAX_CODE_WORDS];
-static size_t code_words = 0;
-static uint32_t org_address = 0;
 
-static void emit_enc(Enc e) {
-    for (int i = 0; i < e.nwords; i++) {
-        if (code_words >= MAX_CODE_WORDS) { fprintf(stderr, "FATAL: code buffer overflow\n"); exit(2); }
-        code[code_words++] = e.words[i];
+// second_pass checks the program fits before emitting.
+static void emit_enc(Asm* a, Enc e) {
+    for (int i = 0; i < e.nwords; i++) a->code[a->code_words++] = e.words[i];
+}
+
+static uint32_t cur_ip(Asm* a) { return a->org_address + (uint32_t)(a->code_words * 2); }
+
+// ---------- source ----------
+// The whole file is read once; lines are split and tokenized in place.
+static char* read_source(const char* path, size_t* len) {
+    FILE* in = fopen(path, "rb");
+    if (!in) return NULL;
+    char* src = NULL;
+    size_t n = 0, cap = 0;
+    for (;;) {
+        if (cap - n < 65536) {
+            cap = cap ? cap * 2 : 65536;
+            src = (char*)realloc(src, cap + 1);
+            if (!src) { fprintf(stderr, "FATAL: out of memory\n"); exit(2); }
+        }
+        size_t got = fread(src + n, 1, cap - n, in);
+        if (got == 0) break;
+        n += got;
     }
+    fclose(in);
+    src[n] = 0;
+    *len = n;
+    return src;
 }
 
-static uint32_t cur_ip(void) { return org_address + (uint32_t)(code_words * 2); }
+// ---------- statements ----------
+// The first pass encodes every instruction as soon as its operands are
+// classified, so only symbol operands are left for the second pass to patch.
+// OPK_MEM operands need label addresses; OPK_ERR ones were already reported.
+typedef enum { OPK_NONE, OPK_REG, OPK_IMM, OPK_MEM, OPK_IND, OPK_ERR } OpKind;
+typedef struct { OpKind k; int reg; uint32_t val; const char* sym; } Opr;   // sym: expression for the second pass or NULL
 
-// ---------- first pass: labels + data items + .org ----------
-static void handle_org(int line, const char* rhs) {
-    uint32_t v;
-    if (!parse_number(rhs, &v)) { add_err(line, ".org: bad number '%s'", rhs); return; }
-    if (v >= FORBID_LO && v <= FORBID_HI) { add_err(line, ".org 0x%04X forbidden (BIOS/MMIO)", (unsigned)v); return; }
-    org_address = (uint32_t)v;
+static int check_word(Asm* a, int line, int64_t v) {
+    if (v >= -0x8000 && v <= 0xFFFF) return 1;
+    add_err(a, line, "value %lld does not fit in 16 bits", (long long)v);
+    return 0;
 }
 
-static void first_pass(FILE* in) {
-    char linebuf[MAX_LINE];
-    int line = 0;
-    while (fgets(linebuf, sizeof(linebuf), in)) {
-        line++;
-        rstrip(linebuf);
-        char* s = lskip(linebuf);
-        trim_comm(s);
-        if (!*s) continue;
-
-        // Handle .org directive
-        char low[MAX_LINE];
-        strncpy(low, s, sizeof(low) - 1);
-        low[sizeof(low) - 1] = 0;
-        lower(low);
-        if (strncmp(low, ".org", 4) == 0) {
-            char* p = s + 4;
-            p = lskip(p);
-            if (!*p) { add_err(line, ".org needs value"); continue; }
-            handle_org(line, p);
-            continue;
-        }
+static Opr scan_operand(Asm* a, int line, char* s) {
+    Opr o = {OPK_NONE, -1, 0, NULL};
+    size_t n = strlen(s);
+    if (n >= 2 && s[0] == '[' && s[n - 1] == ']') {
+        char* inner = arena_strdup(a, s + 1);
+        inner[n - 2] = 0;
+        Opr in = scan_operand(a, line, rstrip(lskip(inner)));
+        if (in.k == OPK_IMM || in.k == OPK_MEM) { o = in; o.k = OPK_IND; }
+        else if (in.k == OPK_ERR) o.k = OPK_ERR;
+        return o;
+    }
+    int r = reg_id(s);
+    if (r >= 0) { o.k = OPK_REG; o.reg = r; return o; }
+    if (!*s) return o;
+    Val v;
+    int st = eval_expr(a, line, s, 0, 0, HERE_LATER, &v);
+    if (st < 0 || (st == 0 && !check_word(a, line, v.v))) {
+        o.k = OPK_ERR;
+    } else if (st == 0) {
+        o.k = OPK_IMM;
+        o.val = (uint32_t)(v.v & 0xFFFF);
+    } else {
+        o.k = OPK_MEM;
+        o.sym = s;
+    }
+    return o;
+}
 
-        // Check for label or data directive (e.g., "name: db|dw|dd values")
-        char* col = strchr(s, ':');
-        if (col) {
-            size_t L = (size_t)(col - s);
-            if (L == 0) { add_err(line, "empty label"); continue; }
-            char name[256];
-            strncpy(name, s, L);
-            name[L] = 0;
-            rstrip(name);
-
-            s = lskip(col + 1);
-            trim_comm(s);
-            if (!*s) {
-                // Register as code label if no data type follows
-                if (find_label(name) >= 0) { add_err(line, "duplicate label '%s'", name); }
-                else { add_label(name, cur_ip()); }
-                continue;
-            }
+static void add_stmt(Asm* a, int line, Enc e, const char* sym) {
+    if (a->nstmts == a->stmts_cap) {
+        a->stmts_cap = a->stmts_cap ? a->stmts_cap * 2 : 1024;
+        a->stmts = (Stmt*)realloc(a->stmts, (size_t)a->stmts_cap * sizeof(Stmt));
+        if (!a->stmts) { fprintf(stderr, "FATAL: out of memory\n"); exit(2); }
+    }
+    a->stmts[a->nstmts++] = (Stmt){ e, sym, line, 0, 0 };
+    a->code_words += (size_t)e.nwords;
+}
 
-            strncpy(low, s, sizeof(low) - 1);
-            low[sizeof(low) - 1] = 0;
-            lower(low);
-
-            // Check for data directive after label (e.g., "msg: db values")
-            char type[8] = {0};
-            int i = 0;
-            while (*s && isalpha((unsigned char)*s) && i < 7) type[i++] = *s++;
-            type[i] = 0;
-            s = lskip(s);
-            DType t = 0;
-            if (strcasecmp(type, "db") == 0) t = DT_DB;
-            else if (strcasecmp(type, "dw") == 0) t = DT_DW;
-            else if (strcasecmp(type, "dd") == 0) t = DT_DD;
-            if (t != 0) {
-                if (!*s) { add_err(line, "data '%s' has no values", name); continue; }
-                add_data(line, name, t, s);
-                continue;
-            }
+static void scan_insn(Asm* a, int line, char* s) {
+    char* mnem = s;
+    while (*s && !isspace((unsigned char)*s)) s++;
+    if (*s) *s++ = 0;
+    s = lskip(s);
+    Op op;
+    if (!find_op(mnem, &op)) { add_err(a, line, "unknown mnemonic '%s'", mnem); return; }
 
-            // If not a data directive, register as code label
-            if (find_label(name) >= 0) { add_err(line, "duplicate label '%s'", name); }
-            else { add_label(name, cur_ip()); }
-            continue;
-        }
+    char* a1 = s;
+    char* a2 = "";
+    char* comma = strchr(s, ',');
+    if (comma) { *comma = 0; a2 = lskip(comma + 1); }
+    rstrip(a1);
+    if (op.argc == 2) {
+        if (!*a1 || !*a2) { add_err(a, line, "%s needs 2 args", mnem); return; }
+    } else if (op.argc == 1) {
+        if (!*a1) { add_err(a, line, "%s needs 1 arg", mnem); return; }
+        if (comma) { add_err(a, line, "%s takes 1 arg (got more)", mnem); return; }
+    } else if (*a1) {
+        add_err(a, line, "%s takes no args", mnem);
+    }
+
+    if (op.argc == 0) {
+        add_stmt(a, line, enc_none(op.op), NULL);
+        return;
+    }
+    Opr o1 = scan_operand(a, line, a1);
+    if (o1.k == OPK_ERR) return;
+    if (op.argc == 1) {
+        if (o1.k == OPK_REG) add_stmt(a, line, enc_r(op.op, (uint8_t)o1.reg), NULL);
+        else if (o1.k == OPK_IMM || o1.k == OPK_MEM) add_stmt(a, line, enc_imm(op.op, (uint16_t)(o1.val & 0xFFFF)), o1.sym);
+        else add_err(a, line, "bad operand");
+        return;
+    }
+    Opr o2 = scan_operand(a, line, a2);
+    if (o2.k == OPK_ERR) return;
+    if (o1.k == OPK_REG && o2.k == OPK_REG) {
+        add_stmt(a, line, enc_rr(op.op, (uint8_t)o1.reg, (uint8_t)o2.reg), NULL);
+    } else if (o1.k == OPK_REG && o2.k == OPK_IMM) {
+        uint16_t imm = (uint16_t)(o2.val & 0xFFFF);
+        if (fits_short_imm(imm)) add_stmt(a, line, enc_r_simm(op.op, (uint8_t)o1.reg, imm), NULL);
+        else add_stmt(a, line, enc_r_imm(op.op, (uint8_t)o1.reg, imm), NULL);
+    } else if (o1.k == OPK_REG && o2.k == OPK_MEM) {
+        // Only mov takes mode 4; other ops get the address as an immediate.
+        if (op.op == 2) add_stmt(a, line, enc_r_mem(op.op, (uint8_t)o1.reg, 0), o2.sym);
+        else add_stmt(a, line, enc_r_imm(op.op, (uint8_t)o1.reg, 0), o2.sym);
+    } else if (op.op == 2 && o1.k == OPK_REG && o2.k == OPK_IND) {
+        add_stmt(a, line, enc_r_load((uint8_t)o1.reg, (uint16_t)(o2.val & 0xFFFF)), o2.sym);
+    } else if (op.op == 2 && o1.k == OPK_IND && o2.k == OPK_REG) {
+        add_stmt(a, line, enc_r_store((uint8_t)o2.reg, (uint16_t)(o1.val & 0xFFFF)), o1.sym);
+    } else {
+        add_err(a, line, "unsupported operand combo '%s %s,%s'", mnem, a1, a2);
+    }
+}
+
+// ---------- first pass: tokenize, size, define labels + data + .org ----------
+static void handle_org(Asm* a, int line, const char* rhs) {
+    Val val;
+    int st = eval_expr(a, line, rhs, 0, 0, HERE_NONE, &val);
+    if (st < 0) return;
+    if (st > 0 || val.v < 0 || val.v > 0xFFFF) { add_err(a, line, ".org needs a constant address, got '%s'", rhs); return; }
+    uint32_t v = (uint32_t)val.v;
+    if (v >= FORBID_LO && v <= FORBID_HI) { add_err(a, line, ".org 0x%04X forbidden (BIOS/MMIO)", (unsigned)v); return; }
+    a->org_address = (uint32_t)v;
+}
+
+// "db"/"dw"/"dd", or "resb"/"resw"/"resd" with *reserved set.
+static DType data_type(char** s, int* reserved) {
+    char* p = *s;
+    DType t = 0;
+    *reserved = strncasecmp(p, "res", 3) == 0;
+    if (*reserved) p += 2;
+    else if ((p[0] | 0x20) != 'd') return 0;
+    if (p[2] && !isspace((unsigned char)p[2])) return 0;
+    switch (p[1] | 0x20) {
+        case 'b': t = DT_DB; break;
+        case 'w': t = DT_DW; break;
+        case 'd': t = DT_DD; break;
+        default: return 0;
+    }
+    *s = lskip(p + 2);
+    return t;
+}
+
+// Strips a ';' comment that is not inside a string.
+static void trim_comm(char* s) {
+    int quoted = 0;
+    for (; *s; s++) {
+        if (*s == '"') quoted = !quoted;
+        else if (*s == ';' && !quoted) { *s = 0; break; }
+    }
+}
 
-        // Handle .data directive (e.g., ".data name: db|dw|dd values")
-        if (strncmp(low, ".data", 5) == 0) {
-            char* p = s + 5;
-            p = lskip(p);
-            char name[256] = {0};
-            int i = 0;
-            while (*p && is_ident_char(*p)) name[i++] = *p++;
-            name[i] = 0;
-            p = lskip(p);
-            if (*p != ':') { add_err(line, "data syntax: .data name: type values or name: type values"); continue; }
-            p++;
-            p = lskip(p);
-            char type[8] = {0};
-            i = 0;
-            while (*p && isalpha((unsigned char)*s) && i < 7) type[i++] = *p++;
-            type[i] = 0;
-            p = lskip(p);
-            DType t = 0;
-            if (strcasecmp(type, "db") == 0) t = DT_DB;
-            else if (strcasecmp(type, "dw") == 0) t = DT_DW;
-            else if (strcasecmp(type, "dd") == 0) t = DT_DD;
-            else { add_err(line, "unknown data type '%s'", type); continue; }
-            if (!*p) { add_err(line, "data '%s' has no values", name); continue; }
-            add_data(line, name, t, p);
+// ".global a, b" exports labels from an object file; ".extern a, b" declares
+// labels another object defines.
+static void scan_linkage(Asm* a, int line, int ext, char* list) {
+    char* save;
+    for (char* name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        name = rstrip(lskip(name));
+        const char* p = name;
+        while (is_ident_char((unsigned char)*p)) p++;
+        if (!*name || *p || isdigit((unsigned char)*name)) { add_err(a, line, "bad symbol name '%s'", name); continue; }
+        if (ext) {
+            if (find_sym(a, name) >= 0) { add_err(a, line, "duplicate label '%s'", name); continue; }
+            int si = add_sym(a, name, 0, -1);
+            a->syms[si].flags = SYM_EXTERN;
             continue;
         }
+        if (a->nglobals == a->globals_cap) {
+            a->globals_cap = a->globals_cap ? a->globals_cap * 2 : 64;
+            a->globals = (Global*)realloc(a->globals, (size_t)a->globals_cap * sizeof(Global));
+            if (!a->globals) { fprintf(stderr, "FATAL: out of memory\n"); exit(2); }
+        }
+        a->globals[a->nglobals++] = (Global){ arena_strdup(a, name), line };
     }
 }
 
-// ---------- eval operand (label/data/number/reg) ----------
-typedef enum { OPK_NONE, OPK_REG, OPK_IMM, OPK_MEM } OpKind;
-typedef struct { OpKind k; int reg; uint32_t val; } Opr;
+// "NAME equ expr" or "NAME: equ expr". The expression is checked now and
+// evaluated wherever NAME is used, so it may refer to labels defined later.
+static int is_equ(const char* s) { return strncasecmp(s, "equ", 3) == 0 && isspace((unsigned char)s[3]); }
 
-static Opr parse_operand(const char* s) {
-    Opr o = {OPK_NONE, -1, 0};
-    if (!s || !*s) return o;
-    char tmp[256]; strncpy(tmp, s, sizeof(tmp) - 1); tmp[sizeof(tmp) - 1] = 0; clean_ident(tmp);
-    int r = reg_id(tmp);
-    if (r >= 0) { o.k = OPK_REG; o.reg = r; return o; }
-    uint32_t v;
-    if (parse_number(tmp, &v)) { o.k = OPK_IMM; o.val = v; return o; }
-    int li = find_label(tmp);
-    if (li >= 0) { o.k = OPK_MEM; o.val = labels[li].addr; return o; }
-    for (int i = 0; i < ndata; i++) {
-        if (strcmp(tmp, data_items[i].name) == 0) { o.k = OPK_MEM; o.val = data_items[i].addr; return o; }
+static void define_equ(Asm* a, int line, const char* name, char* expr) {
+    expr = rstrip(lskip(expr));
+    if (find_sym(a, name) >= 0) { add_err(a, line, "duplicate label '%s'", name); return; }
+    Val v;
+    if (eval_expr(a, line, expr, 0, 0, HERE_NONE, &v) < 0) return;
+    int si = add_sym(a, name, 0, -1);
+    a->syms[si].equ = arena_strdup(a, expr);
+}
+
+static void scan_line(Asm* a, int line, char* s) {
+    trim_comm(s);
+    s = rstrip(lskip(s));
+    if (!*s) return;
+
+    if (strncasecmp(s, ".org", 4) == 0 && (!s[4] || isspace((unsigned char)s[4]))) {
+        char* p = lskip(s + 4);
+        if (!*p) { add_err(a, line, ".org needs value"); return; }
+        handle_org(a, line, p);
+        return;
     }
-    return o;
+    if ((strncasecmp(s, ".global", 7) == 0 || strncasecmp(s, ".extern", 7) == 0) && isspace((unsigned char)s[7])) {
+        scan_linkage(a, line, s[1] == 'e' || s[1] == 'E', lskip(s + 7));
+        return;
+    }
+    // ".data name: type values" is the long form of "name: type values"
+    int long_data = strncasecmp(s, ".data", 5) == 0 && isspace((unsigned char)s[5]);
+    if (long_data) s = lskip(s + 5);
+
+    char* p = s;
+    while (is_ident_char((unsigned char)*p)) p++;
+    char* col = lskip(p);
+    if (p > s && !long_data && col > p && is_equ(col)) {
+        *p = 0;
+        define_equ(a, line, s, col + 3);
+        return;
+    }
+    if (*col != ':') {
+        if (long_data) { add_err(a, line, "data syntax: .data name: type values or name: type values"); return; }
+        scan_insn(a, line, s);
+        return;
+    }
+    if (p == s) { add_err(a, line, "empty label"); return; }
+    *p = 0;
+    char* name = s;
+    s = lskip(col + 1);
+
+    int reserved;
+    DType t = data_type(&s, &reserved);
+    if (t != 0) {
+        if (!*s) { add_err(a, line, reserved ? "reservation '%s' has no count" : "data '%s' has no values", name); return; }
+        add_data(a, line, name, t, s, reserved);
+        return;
+    }
+    if (long_data) { add_err(a, line, "unknown data type in '%s'", s); return; }
+    if (is_equ(s)) { define_equ(a, line, name, s + 3); return; }
+    add_label(a, line, name, cur_ip(a));
+    if (*s) scan_insn(a, line, s);    // "name: insn" on one line
 }
 
-// ---------- second pass: encode ----------
-static void second_pass(FILE* in, const char* outpath) {
-    rewind(in);
-    char linebuf[MAX_LINE];
+static void first_pass(Asm* a, char* src, size_t len) {
     int line = 0;
-    while (fgets(linebuf, sizeof(linebuf), in)) {
-        line++;
-        rstrip(linebuf);
-        char* s = lskip(linebuf);
-        trim_comm(s);
-        if (!*s) continue;
-
-        char low[MAX_LINE];
-        strncpy(low, s, sizeof(low) - 1);
-        low[sizeof(low) - 1] = 0;
-        lower(low);
-        if (strncmp(low, ".org", 4) == 0 || strncmp(low, ".data", 5) == 0) {
-            continue;
-        }
+    for (char* s = src; s < src + len; ) {
+        char* nl = memchr(s, '\n', (size_t)(src + len - s));
+        if (nl) *nl = 0;
+        scan_line(a, ++line, s);
+        if (!nl) break;
+        s = nl + 1;
+    }
+    for (int i = 0; i < a->nglobals; i++) {
+        int si = find_sym(a, a->globals[i].name);
+        if (si < 0 || (a->syms[si].flags & SYM_EXTERN)) add_err(a, a->globals[i].line, "global symbol '%s' is not defined", a->globals[i].name);
+        else a->syms[si].flags |= SYM_GLOBAL;
+    }
+}
+
+// ---------- layout ----------
+#define INSN_OP(w) ((w) >> 11)
+#define INSN_R1(w) (((w) >> 8) & 7)
+#define INSN_MODE(w) ((w) & 31)
 
-        char* col = strchr(s, ':');
-        if (col) {
-            size_t L = (size_t)(col - s);
-            char name[256];
-            strncpy(name, s, L);
-            name[L] = 0;
-            rstrip(name);
-            s = lskip(col + 1);
-            trim_comm(s);
-            if (!*s) continue;
-            strncpy(low, s, sizeof(low) - 1);
-            low[sizeof(low) - 1] = 0;
-            lower(low);
-
-            // Skip if it's a data directive
-            char type[8] = {0};
-            int i = 0;
-            while (*s && isalpha((unsigned char)*s) && i < 7) type[i++] = *s++;
-            type[i] = 0;
-            if (strcasecmp(type, "db") == 0 || strcasecmp(type, "dw") == 0 || strcasecmp(type, "dd") == 0) {
+// Places the statements back to back from .org and moves the code labels with them.
+static void layout(Asm* a) {
+    a->code_words = 0;
+    for (int i = 0; i < a->nstmts; i++) {
+        a->stmts[i].addr = cur_ip(a);
+        a->code_words += (size_t)a->stmts[i].enc.nwords;
+    }
+    for (int k = 0; k < a->nsyms; k++) {
+        int st = a->syms[k].stmt;
+        if (st >= 0) a->syms[k].addr = st < a->nstmts ? a->stmts[st].addr : cur_ip(a);
+    }
+}
+
+// ---------- peephole optimizer (-O) ----------
+// Rewrites the encoded statements between the passes. A removed statement
+// keeps its slot with no words, so a label on it falls through to the next
+// live one. Only ZF and SF are kept exact: no instruction tests CF.
+
+static int is_live(Asm* a, int i) { return a->stmts[i].enc.nwords > 0; }
+
+static int next_live(Asm* a, int i) {
+    while (i < a->nstmts && !is_live(a, i)) i++;
+    return i;
+}
+
+static int prev_live(Asm* a, int i) {
+    while (i >= 0 && !is_live(a, i)) i--;
+    return i;
+}
+
+// True if a label lands on any statement in (from, to].
+static int targeted(Asm* a, int from, int to) {
+    for (int i = from + 1; i <= to; i++) if (a->stmts[i].target) return 1;
+    return 0;
+}
+
+// The live statement a code label reaches, or -1 for data, externs and unknown names.
+static int label_stmt(Asm* a, const char* name) {
+    int si = name ? find_sym(a, name) : -1;
+    if (si < 0 || a->syms[si].stmt < 0) return -1;
+    return next_live(a, a->syms[si].stmt);
+}
+
+static int is_insn(Asm* a, int i, int op, int mode) {
+    uint16_t w = a->stmts[i].enc.words[0];
+    return INSN_OP(w) == op && INSN_MODE(w) == mode;
+}
+
+// "op r, 0" in either the short or the long form.
+static int is_imm_zero(Asm* a, int i, int op) {
+    Stmt* st = &a->stmts[i];
+    if (is_insn(a, i, op, 3)) return !st->sym && st->enc.words[1] == 0;
+    return is_insn(a, i, op, MODE_SHORT_IMM) && ((st->enc.words[0] >> 5) & 7) == 0;
+}
+
+// Instructions that leave ZF and SF describing r1, like "cmp r1, 0" would.
+static int sets_flags_from_r1(uint16_t w) {
+    switch (INSN_OP(w)) {
+        case 2: case 3: case 4: case 5: case 8: case 9: case 10: case 11: case 12:
+        case 13: case 14: case 28: case 29:
+            return 1;
+        default:                // DIV and MOD leave the flags alone on divide by zero
+            return 0;
+    }
+}
+
+static void drop_stmt(Asm* a, int i) { a->stmts[i].enc.nwords = 0; }
+
+static void optimize(Asm* a) {
+    int n = a->nstmts, cmps = 0, threads = 0, jumps = 0, pairs = 0;
+    size_t words = a->code_words;
+    for (int k = 0; k < a->nsyms; k++) {
+        if (a->syms[k].stmt >= 0 && a->syms[k].stmt < n) a->stmts[a->syms[k].stmt].target = 1;
+    }
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        for (int i = 0; i < n; i++) {
+            Stmt* st = &a->stmts[i];
+            if (!is_live(a, i)) continue;
+            uint16_t w = st->enc.words[0];
+            int op = INSN_OP(w);
+
+            // cmp r, 0 right after an instruction that already set the flags from r.
+            if (is_imm_zero(a, i, 15)) {
+                int p = prev_live(a, i - 1);
+                if (p >= 0 && !targeted(a, p, i) && sets_flags_from_r1(a->stmts[p].enc.words[0]) &&
+                    INSN_R1(a->stmts[p].enc.words[0]) == INSN_R1(w)) {
+                    drop_stmt(a, i);
+                    cmps++; changed = 1;
+                }
                 continue;
             }
-        }
+            // push r; pop r with nothing jumping in between.
+            if (is_insn(a, i, 16, 1)) {
+                int j = next_live(a, i + 1);
+                if (j < n && is_insn(a, j, 17, 1) && INSN_R1(a->stmts[j].enc.words[0]) == INSN_R1(w) &&
+                    !targeted(a, i, j)) {
+                    drop_stmt(a, i);
+                    drop_stmt(a, j);
+                    pairs++; changed = 1;
+                }
+                continue;
+            }
+            if (INSN_MODE(w) != 5 || !st->sym || !(op == 21 || op == 22 || (op >= 24 && op <= 27))) continue;
 
-        char mnem[64] = {0};
-        int i = 0;
-        while (*s && !isspace((unsigned char)*s) && *s != ':') mnem[i++] = *s++;
-        mnem[i] = 0;
-        s = lskip(s);
-        Op op;
-        if (!find_op(mnem, &op)) { add_err(line, "unknown mnemonic '%s'", mnem); continue; }
-
-        char a1[128] = {0}, a2[128] = {0};
-        if (op.argc == 2) {
-            if (!*s) { add_err(line, "%s needs 2 args", mnem); continue; }
-            split_args(s, a1, a2);
-            if (!*a1 || !*a2) { add_err(line, "%s needs 2 args", mnem); continue; }
-        } else if (op.argc == 1) {
-            if (!*s) { add_err(line, "%s needs 1 arg", mnem); continue; }
-            split_args(s, a1, a2);
-            if (!*a1 || *a2) { if (!*a1) add_err(line, "%s needs 1 arg", mnem); else add_err(line, "%s takes 1 arg (got more)", mnem); continue; }
-        } else {
-            if (*s) add_err(line, "%s takes no args", mnem);
+            // Jump or call to a jmp: go straight to the final label. Only a
+            // plain label is copied; an expression may use $, which means
+            // something else at the jump being threaded.
+            const char* dest = st->sym;
+            int hops = 0;
+            for (int t = label_stmt(a, dest); t >= 0 && t < n && is_insn(a, t, 21, 5) && a->stmts[t].sym &&
+                 find_sym(a, a->stmts[t].sym) >= 0; t = label_stmt(a, dest)) {
+                if (++hops > 16) { dest = st->sym; break; }    // jmp loop
+                dest = a->stmts[t].sym;
+            }
+            if (strcmp(dest, st->sym) != 0) {
+                st->sym = dest;
+                threads++; changed = 1;
+            }
+            // A jump to the next instruction does nothing.
+            if (op != 22 && label_stmt(a, st->sym) == next_live(a, i + 1)) {
+                drop_stmt(a, i);
+                jumps++; changed = 1;
+            }
         }
+    }
+
+    layout(a);
+    if (a->name) fprintf(a->msg, "%s: ", a->name);
+    fprintf(a->msg, "Optimized: %zu word(s) saved, %d instruction(s) removed "
+            "(%d cmp, %d jump(s) threaded, %d jump(s) to next, %d push/pop pair(s))\n",
+            words - a->code_words, cmps + jumps + 2 * pairs, cmps, threads, jumps, pairs);
+}
 
-        Opr o1 = parse_operand(a1);
-        Opr o2 = parse_operand(a2);
+// ---------- branch relaxation ----------
+// Jumps and calls to code labels start out as one-word short branches. Any
+// that end up out of range grow back to two words, until nothing changes.
+// Growing only moves code apart, so the loop ends.
 
-        if (op.argc == 0) {
-            emit_enc(enc_none(op.op));
-            continue;
+static int is_branch_op(int op) { return op == 21 || op == 22 || (op >= 24 && op <= 27); }
+
+static int32_t branch_offset(Asm* a, int i, int si) {
+    return ((int32_t)a->syms[si].addr - (int32_t)(a->stmts[i].addr + 2)) / 2;
+}
+
+static void relax(Asm* a) {
+    for (int i = 0; i < a->nstmts; i++) {
+        Stmt* st = &a->stmts[i];
+        uint16_t w = st->enc.words[0];
+        if (st->enc.nwords != 2 || INSN_MODE(w) != 5 || !st->sym || !is_branch_op(INSN_OP(w))) continue;
+        int si = find_sym(a, st->sym);
+        if (si >= 0 && a->syms[si].stmt >= 0) st->enc = enc_short_branch(INSN_OP(w), 0);
+    }
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        layout(a);
+        for (int i = 0; i < a->nstmts; i++) {
+            Stmt* st = &a->stmts[i];
+            if (st->enc.nwords != 1 || INSN_MODE(st->enc.words[0]) < MODE_SHORT_BRANCH) continue;
+            if (!fits_short_branch(branch_offset(a, i, find_sym(a, st->sym)))) {
+                st->enc = enc_imm(INSN_OP(st->enc.words[0]), 0);
+                changed = 1;
+            }
         }
-        if (op.argc == 1) {
-            if (o1.k == OPK_REG) emit_enc(enc_r(op.op, (uint8_t)o1.reg));
-            else if (o1.k == OPK_IMM || o1.k == OPK_MEM) emit_enc(enc_imm(op.op, (uint16_t)(o1.val & 0xFFFF)));
-            else add_err(line, "bad operand");
+    }
+}
+
+// ---------- object output ----------
+// Every operand that is an address gets a relocation, so the linker can move
+// this file's text and data and fill in imports.
+
+static void add_reloc(Asm* a, uint32_t word, int sym, int32_t addend) {
+    if (a->nrelocs == a->relocs_cap) {
+        a->relocs_cap = a->relocs_cap ? a->relocs_cap * 2 : 1024;
+        a->relocs = (ObjReloc*)realloc(a->relocs, (size_t)a->relocs_cap * sizeof(ObjReloc));
+        if (!a->relocs) { fprintf(stderr, "FATAL: out of memory\n"); exit(2); }
+    }
+    a->relocs[a->nrelocs++] = (ObjReloc){ word, (uint32_t)sym, addend };
+}
+
+static int write_object(Asm* a, const char* outpath) {
+    uint32_t strtab_size = 0;
+    for (int i = 0; i < a->nsyms; i++) strtab_size += (uint32_t)strlen(a->syms[i].name) + 1;
+    ObjHeader hdr = { OBJ_MAGIC, OBJ_VERSION, 0, a->org_address, (uint32_t)a->code_words, DATA_BASE,
+                      a->data_base - DATA_BASE, (uint32_t)a->nsyms, (uint32_t)a->nrelocs, strtab_size };
+    uint8_t* data = (uint8_t*)calloc(1, hdr.data_size + 1);
+    ObjSymbol* osyms = (ObjSymbol*)calloc((size_t)a->nsyms + 1, sizeof(ObjSymbol));
+    char* strtab = (char*)malloc(strtab_size + 1);
+    if (!data || !osyms || !strtab) { fprintf(stderr, "FATAL: out of memory\n"); exit(2); }
+    for (int i = 0; i < a->ndata; i++) memcpy(data + a->data_items[i].addr - DATA_BASE, a->data_items[i].raw, a->data_items[i].count);
+    uint32_t off = 0;
+    for (int i = 0; i < a->nsyms; i++) {
+        Symbol* sym = &a->syms[i];
+        osyms[i].name = off;
+        strcpy(strtab + off, sym->name);
+        off += (uint32_t)strlen(sym->name) + 1;
+        if (sym->flags & SYM_EXTERN) {
+            osyms[i].section = OBJ_UNDEF;
+            osyms[i].bind = OBJ_GLOBAL;
             continue;
         }
-        if (o1.k == OPK_REG && o2.k == OPK_REG) {
-            emit_enc(enc_rr(op.op, (uint8_t)o1.reg, (uint8_t)o2.reg));
-        } else if (o1.k == OPK_REG && o2.k == OPK_IMM) {
-            emit_enc(enc_r_imm(op.op, (uint8_t)o1.reg, (uint16_t)(o2.val & 0xFFFF)));
-        } else if (o1.k == OPK_REG && o2.k == OPK_MEM) {
-            emit_enc(enc_r_mem(op.op, (uint8_t)o1.reg, (uint16_t)(o2.val & 0xFFFF)));
+        if (sym->equ) {             // Checked by second_pass
+            Val v;
+            eval_expr(a, 0, sym->equ, 1, 1, HERE_NONE, &v);
+            osyms[i].section = v.sect == SEC_TEXT ? OBJ_TEXT : v.sect == SEC_DATA ? OBJ_DATA : OBJ_ABS;
+            osyms[i].value = (uint32_t)(v.v - (v.sect == SEC_TEXT ? a->org_address : v.sect == SEC_DATA ? DATA_BASE : 0));
         } else {
-            add_err(line, "unsupported operand combo '%s %s,%s'", mnem, a1, a2);
+            osyms[i].section = sym->data >= 0 ? OBJ_DATA : OBJ_TEXT;
+            osyms[i].value = sym->addr - (sym->data >= 0 ? DATA_BASE : a->org_address);
         }
+        osyms[i].bind = (sym->flags & SYM_GLOBAL) ? OBJ_GLOBAL : OBJ_LOCAL;
     }
-    if (has_errors()) {
-        flush_errors();
-        fprintf(stderr, "Compilation failed. No output.\n");
-        return;
+
+    FILE* out = fopen(outpath, "wb");
+    if (!out) {
+        fprintf(a->err, "Cannot open %s for write\n", outpath);
+        free(data); free(osyms); free(strtab);
+        return -1;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    fwrite(a->code, sizeof(uint16_t), a->code_words, out);
+    fwrite(data, 1, hdr.data_size, out);
+    fwrite(osyms, sizeof(ObjSymbol), (size_t)a->nsyms, out);
+    fwrite(a->relocs, sizeof(ObjReloc), (size_t)a->nrelocs, out);
+    fwrite(strtab, 1, strtab_size, out);
+    int ret = fclose(out) == 0 ? 0 : -1;
+    if (ret == 0) {
+        fprintf(a->msg, "Compiled %zu word(s) to %s (%d symbol(s), %d relocation(s))\n",
+                a->code_words, outpath, a->nsyms, a->nrelocs);
+    } else {
+        fprintf(a->err, "Cannot write %s\n", outpath);
     }
+    free(data);
+    free(osyms);
+    free(strtab);
+    return ret;
+}
 
+// ---------- program output ----------
+
+// Old layout: the whole address range up to the last byte, loaded at 0.
+static int write_flat(Asm* a, const char* outpath) {
     FILE* out = fopen(outpath, "wb");
-    if (!out) { fprintf(stderr, "Cannot open %s for write\n", outpath); exit(1); }
-    if (org_address > 0) fseek(out, (long)org_address, SEEK_SET);
-    fwrite(code, sizeof(uint16_t), code_words, out);
-    for (int i = 0; i < ndata; i++) {
-        fseek(out, (long)data_items[i].addr, SEEK_SET);
-        fwrite(data_items[i].raw, 1, data_items[i].count, out);
+    if (!out) { fprintf(a->err, "Cannot open %s for write\n", outpath); return 1; }
+    if (a->org_address > 0) fseek(out, (long)a->org_address, SEEK_SET);
+    fwrite(a->code, sizeof(uint16_t), a->code_words, out);
+    for (int i = 0; i < a->ndata; i++) {
+        fseek(out, (long)a->data_items[i].addr, SEEK_SET);
+        fwrite(a->data_items[i].raw, 1, a->data_items[i].count, out);
+    }
+    if (fclose(out) != 0) { fprintf(a->err, "Cannot write %s\n", outpath); return 1; }
+    return 0;
+}
+
+// Executable (executable.h): a text segment at .org, a data segment up to the
+// last initialized item, and a BSS range covering the reservations after it
+// and the gap up to the text, which the flat layout used to fill with zeros.
+// Data is written after text so that it wins where the two overlap, as before.
+static int write_executable(Asm* a, const char* outpath) {
+    uint32_t init_end = DATA_BASE;
+    for (int i = 0; i < a->ndata; i++) {
+        if (!a->data_items[i].reserved) init_end = a->data_items[i].addr + (uint32_t)a->data_items[i].count;
+    }
+    uint32_t bss_end = a->org_address >= a->data_base ? a->org_address : a->data_base;
+    ExeHeader hdr = { EXE_MAGIC, EXE_VERSION, 0, a->org_address, init_end, bss_end - init_end };
+    ExeSegment segs[2];
+    if (a->code_words) segs[hdr.nsegments++] = (ExeSegment){ a->org_address, (uint32_t)a->code_words * 2, EXE_TEXT };
+    if (init_end > DATA_BASE) segs[hdr.nsegments++] = (ExeSegment){ DATA_BASE, init_end - DATA_BASE, 0 };
+
+    FILE* out = fopen(outpath, "wb");
+    if (!out) { fprintf(a->err, "Cannot open %s for write\n", outpath); return 1; }
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    fwrite(segs, sizeof(ExeSegment), hdr.nsegments, out);
+    fwrite(a->code, sizeof(uint16_t), a->code_words, out);
+    for (int i = 0; i < a->ndata; i++) {
+        // Items are in address order; alignment gaps come out as zeros.
+        DataItem* d = &a->data_items[i];
+        if (d->addr >= init_end) break;
+        long pos = (long)(sizeof(hdr) + hdr.nsegments * sizeof(ExeSegment) + a->code_words * 2 + (d->addr - DATA_BASE));
+        fseek(out, pos, SEEK_SET);
+        fwrite(d->raw, 1, d->count, out);
+    }
+    if (fclose(out) != 0) { fprintf(a->err, "Cannot write %s\n", outpath); return 1; }
+    return 0;
+}
+
+// ---------- second pass: patch symbol operands, emit ----------
+// Returns 0 on success, 1 if the output could not be written, 2 on errors.
+static int second_pass(Asm* a, const char* outpath, int object) {
+    if (a->code_words > MAX_CODE_WORDS) {
+        add_err(a, 0, "program is %zu words, the limit is %d", a->code_words, MAX_CODE_WORDS);
+        a->nstmts = 0;
+    }
+    a->code_words = 0;
+    for (int i = 0; i < a->nstmts; i++) {
+        Stmt* st = &a->stmts[i];
+        if (st->sym && st->enc.nwords == 1) {   // Short branch, PC-relative: no relocation
+            st->enc = enc_short_branch(INSN_OP(st->enc.words[0]), branch_offset(a, i, find_sym(a, st->sym)));
+        } else if (st->sym && st->enc.nwords == 2) {
+            Val v;
+            if (eval_expr(a, st->line, st->sym, 1, object, st->addr, &v) != 0 || !check_word(a, st->line, v.v)) continue;
+            st->enc.words[1] = (uint16_t)(v.v & 0xFFFF);
+            if (v.sect != SEC_ABS) {
+                if (v.sym < 0) { add_err(a, st->line, "'$' can only appear as '$ - label' in object files"); continue; }
+                int32_t addend = (int32_t)(v.sect == SEC_EXTERN ? v.v : v.v - a->syms[v.sym].addr);
+                add_reloc(a, (uint32_t)a->code_words + 1, v.sym, addend);
+            }
+        }
+        emit_enc(a, st->enc);
+    }
+    for (int i = 0; i < a->nsyms; i++) {
+        Val v;
+        if (!a->syms[i].equ || eval_expr(a, 0, a->syms[i].equ, 1, object, HERE_NONE, &v) != 0) continue;
+        if (v.sect == SEC_EXTERN && (a->syms[i].flags & SYM_GLOBAL)) {
+            add_err(a, 0, "global '%s' is defined from an external symbol", a->syms[i].name);
+        }
     }
-    fclose(out);
-    printf("Compiled %zu word(s) to %s (org=0x%04X, data_end=0x%04X)\n",
-           code_words, outpath, (unsigned)org_address, (unsigned)data_base);
+    if (has_errors(a)) {
+        flush_errors(a);
+        if (a->name) fprintf(a->err, "%s: ", a->name);
+        fprintf(a->err, "Compilation failed. No output.\n");
+        return 2;
+    }
+    if (object) return write_object(a, outpath) == 0 ? 0 : 1;
+
+    int ret = a->flat ? write_flat(a, outpath) : write_executable(a, outpath);
+    if (ret != 0) return ret;
+    fprintf(a->msg, "Compiled %zu word(s) to %s (org=0x%04X, data_end=0x%04X)\n",
+            a->code_words, outpath, (unsigned)a->org_address, (unsigned)a->data_base);
+    return 0;
+}
+
+// ---------- debug sidecar ----------
+// A text file next to the binary, read by annotate:
+//   CXDBG 1
+//   file <source path>
+//   line <address> <source line>      one per instruction, in address order
+//   sym <address> T|D <name>          code labels and named data
+
+static char* swap_ext(const char* path, const char* from, const char* to) {
+    size_t n = strlen(path), k = strlen(from);
+    if (n > k && strcasecmp(path + n - k, from) == 0) n -= k;
+    char* out = (char*)malloc(n + strlen(to) + 1);
+    if (!out) { fprintf(stderr, "FATAL: out of memory\n"); exit(2); }
+    memcpy(out, path, n);
+    strcpy(out + n, to);
+    return out;
+}
+
+static int write_debug(Asm* a, const char* inpath, const char* outpath) {
+    char* path = swap_ext(outpath, ".bin", ".dbg");
+    FILE* out = fopen(path, "w");
+    if (!out) { fprintf(a->err, "Cannot open %s for write\n", path); free(path); return -1; }
+    fprintf(out, "CXDBG 1\nfile %s\n", inpath);
+    for (int i = 0; i < a->nstmts; i++) {
+        if (a->stmts[i].enc.nwords == 0) continue;    // Removed by -O
+        fprintf(out, "line 0x%04X %d\n", (unsigned)a->stmts[i].addr, a->stmts[i].line);
+    }
+    for (int i = 0; i < a->nsyms; i++) {
+        Symbol* sym = &a->syms[i];
+        if (!(sym->flags & SYM_EXTERN) && !sym->equ) fprintf(out, "sym 0x%04X %c %s\n", (unsigned)sym->addr, sym->data >= 0 ? 'D' : 'T', sym->name);
+    }
+    int ret = fclose(out) == 0 ? 0 : -1;
+    if (ret != 0) fprintf(a->err, "Cannot write %s\n", path);
+    free(path);
+    return ret;
+}
+
+// ---------- driver ----------
+static Asm* asm_new(const char* name, FILE* err, FILE* msg) {
+    Asm* a = (Asm*)calloc(1, sizeof(Asm));
+    if (!a) { fprintf(stderr, "FATAL: out of memory\n"); exit(2); }
+    a->name = name;
+    a->err = err;
+    a->msg = msg;
+    a->data_base = DATA_BASE;
+    return a;
+}
+
+static void asm_free(Asm* a) {
+    free(a->errs);
+    free(a->relocs);
+    free(a->globals);
+    free(a->stmts);
+    free(a->syms);
+    free(a->sym_table);
+    free(a->data_items);
+    arena_free(a);
+    free(a);
+}
+
+// Returns 0 on success, 1 on I/O errors, 2 on assembly errors.
+static int assemble(Asm* a, const char* inpath, const char* outpath, int object) {
+    size_t len;
+    char* src = read_source(inpath, &len);
+    if (!src) { fprintf(a->err, "Cannot open %s\n", inpath); return 1; }
+    first_pass(a, src, len);
+    if (a->optimize && !has_errors(a)) optimize(a);
+    if (!has_errors(a)) relax(a);
+    int ret = second_pass(a, outpath, object);
+    if (ret == 0 && a->debug && write_debug(a, inpath, outpath) != 0) ret = 1;
+    free(src);
+    return ret;
+}
+
+// ---------- batch mode ----------
+// Worker threads take the next input until none are left. Each file's
+// diagnostics are collected in memory and printed as one block.
+typedef struct {
+    char** inputs;
+    int ninputs;
+    int object;
+    int optimize;
+    int debug;
+    int flat;
+    int next;
+    int status;                 // Worst assemble() result
+    pthread_mutex_t lock;
+} Batch;
+
+static char* output_path(const char* in, int object) {
+    return swap_ext(in, ".asm", object ? ".o" : ".bin");
+}
+
+static void* batch_worker(void* arg) {
+    Batch* b = (Batch*)arg;
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        int i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->ninputs) break;
+
+        char *errbuf = NULL, *msgbuf = NULL;
+        size_t errlen = 0, msglen = 0;
+        FILE* err = open_memstream(&errbuf, &errlen);
+        FILE* msg = open_memstream(&msgbuf, &msglen);
+        if (!err || !msg) { fprintf(stderr, "FATAL: out of memory\n"); exit(2); }
+        char* outpath = output_path(b->inputs[i], b->object);
+        Asm* a = asm_new(b->inputs[i], err, msg);
+        a->optimize = b->optimize;
+        a->debug = b->debug;
+        a->flat = b->flat;
+        int ret = assemble(a, b->inputs[i], outpath, b->object);
+        asm_free(a);
+        free(outpath);
+        fclose(err);
+        fclose(msg);
+
+        pthread_mutex_lock(&b->lock);
+        fputs(errbuf, stderr);
+        fputs(msgbuf, stdout);
+        if (ret > b->status) b->status = ret;
+        pthread_mutex_unlock(&b->lock);
+        free(errbuf);
+        free(msgbuf);
+    }
+    return NULL;
+}
+
+static int run_batch(char** inputs, int ninputs, int object, int optimize, int debug, int flat, int jobs) {
+    Batch b = { inputs, ninputs, object, optimize, debug, flat, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+    if (jobs > ninputs) jobs = ninputs;
+    pthread_t* threads = (pthread_t*)malloc((size_t)jobs * sizeof(pthread_t));
+    if (!threads) { fprintf(stderr, "FATAL: out of memory\n"); exit(2); }
+    int started = 0;
+    for (; started < jobs; started++) {
+        if (pthread_create(&threads[started], NULL, batch_worker, &b) != 0) break;
+    }
+    if (started == 0) batch_worker(&b);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+    return b.status;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-c|-g] [-O] [-f] <input.asm> <output.bin|output.o>\n", prog);
+    fprintf(stderr, "       %s [-c|-g] [-O] [-f] [-j N] -b <input.asm>...\n", prog);
+    fprintf(stderr, "  -c    write a relocatable object for linker instead of an executable\n");
+    fprintf(stderr, "  -f    write a flat image loaded at 0 instead of a segmented executable\n");
+    fprintf(stderr, "  -g    also write <output>.dbg with line numbers and symbols, for annotate\n");
+    fprintf(stderr, "  -O    peephole-optimize the code and report what it saved\n");
+    fprintf(stderr, "  -b    batch: assemble every input to <input>.bin (or .o) in parallel\n");
+    fprintf(stderr, "  -j N  batch worker threads (default: one per CPU)\n");
 }
 
 // ---------- main ----------
 int main(int argc, char** argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <input.asm> <output.bin>\n", argv[0]);
+    int object = 0, batch = 0, optimize = 0, debug = 0, flat = 0;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-c") == 0) object = 1;
+        else if (strcmp(argv[i], "-b") == 0) batch = 1;
+        else if (strcmp(argv[i], "-O") == 0) optimize = 1;
+        else if (strcmp(argv[i], "-g") == 0) debug = 1;
+        else if (strcmp(argv[i], "-f") == 0) flat = 1;
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) jobs = atoi(argv[++i]);
+        else { usage(argv[0]); return 1; }
+    }
+    if (jobs < 1) jobs = 1;
+    if (object && (debug || flat)) {
+        fprintf(stderr, "%s describes a program binary; it cannot be combined with -c\n", debug ? "-g" : "-f");
         return 1;
     }
-    FILE* in = fopen(argv[1], "r");
-    if (!in) { fprintf(stderr, "Cannot open %s\n", argv[1]); return 1; }
-    first_pass(in);
-    second_pass(in, argv[2]);
-    for (int i = 0; i < nlabels; i++) free(labels[i].name);
-    for (int i = 0; i < ndata; i++) { free(data_items[i].name); free(data_items[i].raw); }
-    fclose(in);
-    return has_errors() ? 2 : 0;
+    if (batch) {
+        if (i == argc) { usage(argv[0]); return 1; }
+        return run_batch(argv + i, argc - i, object, optimize, debug, flat, (int)jobs);
+    }
+    if (argc - i != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    Asm* a = asm_new(NULL, stderr, stdout);
+    a->optimize = optimize;
+    a->debug = debug;
+    a->flat = flat;
+    int ret = assemble(a, argv[i], argv[i + 1], object);
+    asm_free(a);
+    return ret;
 }
-
@@ -16,29 +16,57 @@ BIOS* bios_init() {
     }
 
     bios->disk = disk_init();
+    const char* share = getenv("CORX_HOSTFS_DIR");
+    bios->hostfs = hostfs_init(share && *share ? share : HOSTFS_DIR);
     bios->history = (char**)calloc(HISTORY_SIZE, sizeof(char*));
     bios->history_count = 0;
     bios->history_index = -1;
     bios->initial_screen = 1;
 
-    // Scan for .bin files
-    DIR* dir = opendir("bin");
-    if (dir) {
-        struct dirent* entry;
-        while ((entry = readdir(dir)) != NULL) {
-            if (strstr(entry->d_name, ".bin") && bios->file_count < MAX_FILES) {
-                bios->file_list[bios->file_count] = strndup(entry->d_name, MAX_FILENAME);
-                bios->file_count++;
-            }
-        }
-        closedir(dir);
-    } else {
-        fprintf(stderr, "BIOS: Failed to open bin directory: %s\n", strerror(errno));
-    }
+    // Program images in bin/ are cached by the library and watched for changes
+    bios->library = library_init("bin");
+    bios->library_generation = library_generation(bios->library) - 1;
+    bios_refresh_programs(bios);
 
     return bios;
 }
 
+// Rebuilds the boot menu listing if the program library changed on disk.
+void bios_refresh_programs(BIOS* bios) {
+    library_poll(bios->library);
+    unsigned gen = library_generation(bios->library);
+    if (gen == bios->library_generation) return;
+    bios->library_generation = gen;
+
+    for (int i = 0; i < bios->file_count; i++) {
+        free(bios->file_list[i]);
+    }
+    bios->file_count = 0;
+    for (int i = 0; i < library_count(bios->library) && bios->file_count < MAX_FILES; i++) {
+        bios->file_list[bios->file_count++] = strndup(library_name(bios->library, i), MAX_FILENAME);
+    }
+    if (bios->selected_file >= bios->file_count) {
+        bios->selected_file = bios->file_count > 0 ? bios->file_count - 1 : 0;
+    }
+}
+
+// Loads the program at `index` in the boot menu from the library cache.
+// Returns 1 on success; the CPU is left untouched on failure. The old
+// program's async disk requests are cancelled first, so none of them writes
+// into the new image or completes (INT 11, polling) under the new program.
+int bios_load_program(CPU* cpu, BIOS* bios, int index) {
+    if (index < 0 || index >= bios->file_count) return 0;
+    size_t size = 0;
+    const uint8_t* image = library_image(bios->library, bios->file_list[index], &size);
+    if (!image || cpu_check_image(cpu, image, size) != 0) return 0;
+    disk_cancel_requests(bios->disk);
+    bios->disk_irq_signaled = disk_completed(bios->disk);
+    if (cpu_load_image(cpu, image, size) != 0) return 0;
+    free(bios->program_file);
+    bios->program_file = strdup(bios->file_list[index]);
+    return 1;
+}
+
 void bios_cleanup(BIOS* bios) {
     for (int i = 0; i < bios->file_count; i++) {
         free(bios->file_list[i]);
@@ -49,6 +77,8 @@ void bios_cleanup(BIOS* bios) {
     free(bios->history);
     free(bios->program_output);
     free(bios->program_file);
+    library_cleanup(bios->library);
+    hostfs_cleanup(bios->hostfs);
     disk_cleanup(bios->disk);
     free(bios);
 }
@@ -100,6 +130,84 @@ void bios_poll_input(BIOS* bios) {
     }
 }
 
+void bios_console_append(BIOS* bios, const char* text, size_t len) {
+    if (bios->output_len + len + 1 > bios->output_cap || !bios->program_output) {
+        size_t cap = bios->output_cap ? bios->output_cap : 256;
+        while (cap < bios->output_len + len + 1) cap *= 2;
+        char* grown = realloc(bios->program_output, cap);
+        if (!grown) return;
+        bios->program_output = grown;
+        bios->output_cap = cap;
+    }
+    memcpy(bios->program_output + bios->output_len, text, len);
+    bios->output_len += len;
+    bios->program_output[bios->output_len] = '\0';
+}
+
+void bios_console_clear(BIOS* bios) {
+    free(bios->program_output);
+    bios->program_output = NULL;
+    bios->output_len = 0;
+    bios->output_cap = 0;
+}
+
+// Expands a printf-style template stored in guest memory at `fmt`.
+// Supported: %d %u %x %X %c %s %% with an optional zero/width prefix (%04x).
+// Arguments come from BX, CX, DX and then from the stack, starting at SP;
+// %s takes the guest address of a null-terminated string. Other conversions
+// are copied through and take no argument; %c of 0 prints nothing.
+static size_t format_guest_string(CPU* cpu, uint16_t fmt, char* out, size_t cap) {
+    const uint8_t* mem = (const uint8_t*)cpu->memory;
+    size_t max_addr = cpu->memory_size * sizeof(uint16_t);
+    size_t n = 0;
+    size_t p = fmt;
+    int argi = 1;
+    uint16_t sp = cpu->sp;
+
+    while (p < max_addr && mem[p] && n < cap - 1) {
+        char c = (char)mem[p++];
+        if (c != '%') { out[n++] = c; continue; }
+        if (p >= max_addr || !mem[p]) break;
+
+        char pad = ' ';
+        size_t width = 0;
+        if (mem[p] == '0') { pad = '0'; p++; }
+        while (p < max_addr && mem[p] >= '0' && mem[p] <= '9') {
+            width = width * 10 + (mem[p++] - '0');
+            if (width > cap) width = cap;
+        }
+        if (p >= max_addr || !mem[p]) break;
+        char spec = (char)mem[p++];
+        if (spec == '%') { out[n++] = '%'; continue; }
+
+        uint16_t arg = 0;
+        if (strchr("duxXcs", spec)) {
+            if (argi < NUM_REGISTERS) arg = cpu->registers[argi++];
+            else if (sp < cpu->memory_size + cpu->stack_size) arg = cpu->memory[sp++];
+        }
+
+        char tmp[MAX_FILENAME];
+        const char* src = tmp;
+        size_t len = 0;
+        switch (spec) {
+            case 'd': len = (size_t)snprintf(tmp, sizeof(tmp), "%d", (int16_t)arg); break;
+            case 'u': len = (size_t)snprintf(tmp, sizeof(tmp), "%u", arg); break;
+            case 'x': len = (size_t)snprintf(tmp, sizeof(tmp), "%x", arg); break;
+            case 'X': len = (size_t)snprintf(tmp, sizeof(tmp), "%X", arg); break;
+            case 'c': tmp[0] = (char)(arg & 0xFF); len = tmp[0] ? 1 : 0; break;
+            case 's':
+                src = (const char*)mem + arg;
+                while (arg + len < max_addr && src[len]) len++;
+                break;
+            default: tmp[0] = '%'; tmp[1] = spec; len = 2; break;
+        }
+        for (size_t w = len; w < width && n < cap - 1; w++) out[n++] = pad;
+        for (size_t i = 0; i < len && n < cap - 1; i++) out[n++] = src[i];
+    }
+    out[n] = '\0';
+    return n;
+}
+
 static void copy_line_to_mem_and_clear(CPU* cpu, BIOS* bios, uint16_t addr) {
     uint8_t* mem = (uint8_t*)cpu->memory;
     size_t max = cpu->memory_size * sizeof(uint16_t);
@@ -116,6 +224,31 @@ static void copy_line_to_mem_and_clear(CPU* cpu, BIOS* bios, uint16_t addr) {
     bios->read_line_active = 0;
 }
 
+// Checks that [addr, addr + len) lies inside guest program memory.
+static int guest_range_ok(CPU* cpu, uint16_t addr, size_t len) {
+    return (size_t)addr + len <= cpu->memory_size * sizeof(uint16_t);
+}
+
+// Copies a NUL-terminated guest string of at most cap - 1 bytes.
+static int guest_string(CPU* cpu, uint16_t addr, char* out, size_t cap) {
+    size_t max = cpu->memory_size * sizeof(uint16_t);
+    if (addr >= max) return 0;
+    size_t n = max - addr < cap - 1 ? max - addr : cap - 1;
+    strncpy(out, (const char*)cpu->memory + addr, n);
+    out[n] = '\0';
+    return 1;
+}
+
+// Raises DISK_IRQ once per finished async disk request if the guest hooked it.
+// With the vector at its BIOS default, completions are only reported via polling.
+void bios_service_irqs(CPU* cpu, BIOS* bios) {
+    unsigned completed = disk_completed(bios->disk);
+    if (completed == bios->disk_irq_signaled) return;
+    int r = cpu_raise_irq(cpu, DISK_IRQ);
+    if (r == 1) bios->disk_irq_signaled++;
+    else if (r == 0) bios->disk_irq_signaled = completed;
+}
+
 void bios_handle_interrupt(CPU* cpu, BIOS* bios) {
     if (cpu->interrupt == 0) return;
 
@@ -132,8 +265,8 @@ void bios_handle_interrupt(CPU* cpu, BIOS* bios) {
                 buffer[i++] = (char)byte;
             }
             buffer[i] = '\0';
-            free(bios->program_output);
-            bios->program_output = strdup(buffer);
+            bios_console_clear(bios);
+            bios_console_append(bios, buffer, i);
             printf("Output: %s\n", bios->program_output);
             break;
         }
@@ -141,20 +274,12 @@ void bios_handle_interrupt(CPU* cpu, BIOS* bios) {
             uint8_t func = cpu->registers[0] & 0xFF;
             switch (func) {
                 case 0x01: { // Append newline
-                    size_t len = bios->program_output ? strlen(bios->program_output) : 0;
-                    char* temp = malloc(len + 2);
-                    if (temp) {
-                        if (bios->program_output) strcpy(temp, bios->program_output);
-                        temp[len] = '\n';
-                        temp[len + 1] = '\0';
-                        free(bios->program_output);
-                        bios->program_output = temp;
-                    }
+                    bios_console_append(bios, "\n", 1);
                     break;
                 }
                 case 0x02: { // Clear output
-                    free(bios->program_output);
-                    bios->program_output = strdup("");
+                    bios_console_clear(bios);
+                    bios_console_append(bios, "", 0);
                     break;
                 }
                 default:
@@ -170,19 +295,21 @@ void bios_handle_interrupt(CPU* cpu, BIOS* bios) {
         }
         case 6: { // Load program
             uint16_t file_idx = cpu->registers[0];
-            if (file_idx < bios->file_count) {
-                char filepath[256];
-                snprintf(filepath, sizeof(filepath), "bin/%s", bios->file_list[file_idx]);
-                free(bios->program_file);
-                bios->program_file = strdup(bios->file_list[file_idx]);
-                cpu_load_program(cpu, filepath);
-                cpu->running = (cpu->program_size > 0);
-                cpu->zero_flag = cpu->running ? 0 : 1;
+            if (bios_load_program(cpu, bios, file_idx)) {
+                cpu->running = 1;
+                cpu->zero_flag = 0;
             } else {
                 cpu->zero_flag = 1;
             }
             break;
         }
+        case 7: { // Formatted print
+            char buffer[1024];
+            size_t n = format_guest_string(cpu, cpu->registers[0], buffer, sizeof(buffer));
+            bios_console_append(bios, buffer, n);
+            printf("Output: %s\n", buffer);
+            break;
+        }
         case 1: { // Keyboard input
             uint8_t func = cpu->registers[0] & 0xFF;
             switch (func) {
@@ -261,14 +388,18 @@ void bios_handle_interrupt(CPU* cpu, BIOS* bios) {
         case 10: { // Disk operations
             uint8_t func = cpu->registers[0] & 0xFF;
             switch (func) {
-                case 0x01: { // Read
-                    disk_read(bios->disk, cpu->registers[1], cpu->registers[2], (uint8_t*)cpu->memory);
-                    cpu->zero_flag = (disk_status(bios->disk) == 0) ? 0 : 1;
-                    break;
-                }
+                case 0x01:   // Read
                 case 0x02: { // Write
-                    disk_write(bios->disk, cpu->registers[1], cpu->registers[2], (uint8_t*)cpu->memory);
-                    cpu->zero_flag = (disk_status(bios->disk) == 0) ? 0 : 1;
+                    // BX = disk address, CX = length, DX = buffer; data moves
+                    // straight between the image and guest memory
+                    uint16_t len = cpu->registers[2], buf = cpu->registers[3];
+                    int ret = 1;
+                    if (guest_range_ok(cpu, buf, len) && (uint32_t)cpu->registers[1] + len <= DISK_RAW_SIZE) {
+                        ret = (func == 0x01)
+                            ? disk_read(bios->disk, cpu->registers[1], len, (uint8_t*)cpu->memory + buf)
+                            : disk_write(bios->disk, cpu->registers[1], len, (uint8_t*)cpu->memory + buf);
+                    }
+                    cpu->zero_flag = ret == 0 ? 0 : 1;
                     break;
                 }
                 case 0x03: { // Status
@@ -278,26 +409,187 @@ void bios_handle_interrupt(CPU* cpu, BIOS* bios) {
                 }
                 case 0x04: { // Create file
                     char filename[MAX_FILENAME];
-                    strncpy(filename, (char*)cpu->memory + cpu->registers[1], MAX_FILENAME - 1);
-                    filename[MAX_FILENAME - 1] = '\0';
+                    if (!guest_string(cpu, cpu->registers[1], filename, sizeof(filename))) {
+                        cpu->zero_flag = 1;
+                        break;
+                    }
                     disk_create_file(bios->disk, filename);
                     cpu->zero_flag = (disk_status(bios->disk) == 0) ? 0 : 1;
                     break;
                 }
                 case 0x05: { // Delete file
                     char filename[MAX_FILENAME];
-                    strncpy(filename, (char*)cpu->memory + cpu->registers[1], MAX_FILENAME - 1);
-                    filename[MAX_FILENAME - 1] = '\0';
+                    if (!guest_string(cpu, cpu->registers[1], filename, sizeof(filename))) {
+                        cpu->zero_flag = 1;
+                        break;
+                    }
                     disk_delete_file(bios->disk, filename);
                     cpu->zero_flag = (disk_status(bios->disk) == 0) ? 0 : 1;
                     break;
                 }
+                case 0x06:   // Async read
+                case 0x07: { // Async write
+                    uint16_t len = cpu->registers[2], buf = cpu->registers[3];
+                    uint16_t id = 0;
+                    if (guest_range_ok(cpu, buf, len)) {
+                        id = disk_submit(bios->disk, func == 0x07, cpu->registers[1], len, (uint8_t*)cpu->memory + buf);
+                    }
+                    cpu->registers[0] = id;
+                    cpu->zero_flag = (id != 0) ? 0 : 1;
+                    break;
+                }
+                case 0x08: { // Poll async completion
+                    uint16_t id = 0, status = 0;
+                    if (disk_poll(bios->disk, &id, &status)) {
+                        cpu->registers[0] = id;
+                        cpu->registers[1] = status;
+                        cpu->zero_flag = 0;
+                    } else {
+                        cpu->registers[0] = 0;
+                        cpu->zero_flag = 1;
+                    }
+                    break;
+                }
+                case 0x09: { // Flush to durable storage
+                    disk_flush(bios->disk);
+                    cpu->zero_flag = 0;
+                    break;
+                }
+                case 0x0A:   // File read
+                case 0x0B: { // File write
+                    // BX points to a parameter block: name, offset low, offset high, length, buffer
+                    uint16_t blk = cpu->registers[1];
+                    if (!guest_range_ok(cpu, blk, 5 * sizeof(uint16_t)) || (blk & 1)) {
+                        cpu->zero_flag = 1;
+                        break;
+                    }
+                    uint16_t* p = cpu->memory + blk / 2;
+                    uint32_t offset = p[1] | ((uint32_t)p[2] << 16);
+                    uint16_t len = p[3], buf = p[4];
+                    char filename[MAX_FILENAME];
+                    if (!guest_range_ok(cpu, buf, len) || !guest_string(cpu, p[0], filename, sizeof(filename))) {
+                        cpu->zero_flag = 1;
+                        break;
+                    }
+                    size_t done = len;
+                    int ret = (func == 0x0A)
+                        ? disk_file_read(bios->disk, filename, offset, len, (uint8_t*)cpu->memory + buf, &done)
+                        : disk_file_write(bios->disk, filename, offset, len, (uint8_t*)cpu->memory + buf);
+                    cpu->registers[0] = ret == 0 ? (uint16_t)done : 0;
+                    cpu->zero_flag = ret == 0 ? 0 : 1;
+                    break;
+                }
+                case 0x0C: { // File size
+                    char filename[MAX_FILENAME];
+                    if (!guest_string(cpu, cpu->registers[1], filename, sizeof(filename))) {
+                        cpu->zero_flag = 1;
+                        break;
+                    }
+                    uint32_t size = 0;
+                    int ret = disk_file_size(bios->disk, filename, &size);
+                    cpu->registers[2] = size & 0xFFFF;
+                    cpu->registers[3] = size >> 16;
+                    cpu->zero_flag = ret == 0 ? 0 : 1;
+                    break;
+                }
+                case 0x0D:   // Read sectors
+                case 0x0E: { // Write sectors
+                    // AH = sector count, BX:CX = LBA, DX = buffer
+                    uint16_t count = cpu->registers[0] >> 8, buf = cpu->registers[3];
+                    uint64_t lba = ((uint32_t)cpu->registers[1] << 16) | cpu->registers[2];
+                    uint64_t addr = lba * DISK_SECTOR_SIZE;
+                    size_t len = (size_t)count * DISK_SECTOR_SIZE;
+                    int ret = 1;
+                    if (count > 0 && guest_range_ok(cpu, buf, len) && addr + len <= disk_size(bios->disk)) {
+                        ret = (func == 0x0D)
+                            ? disk_read(bios->disk, (uint32_t)addr, len, (uint8_t*)cpu->memory + buf)
+                            : disk_write_sectors(bios->disk, (uint32_t)addr, len, (uint8_t*)cpu->memory + buf);
+                    }
+                    cpu->registers[0] = ret == 0 ? count : 0;
+                    cpu->zero_flag = ret == 0 ? 0 : 1;
+                    break;
+                }
+                case 0x0F: { // Disk geometry
+                    uint32_t sectors = (uint32_t)(disk_size(bios->disk) / DISK_SECTOR_SIZE);
+                    cpu->registers[0] = DISK_SECTOR_SIZE;
+                    cpu->registers[1] = sectors >> 16;
+                    cpu->registers[2] = sectors & 0xFFFF;
+                    cpu->zero_flag = 0;
+                    break;
+                }
                 default:
                     cpu->zero_flag = 1;
                     break;
             }
             break;
         }
+        case 12: { // Host directory
+            uint8_t func = cpu->registers[0] & 0xFF;
+            HostFs* fs = bios->hostfs;
+            int ok = 0;
+            switch (func) {
+                case 0x01: { // Open: BX = name, CX = flags -> AX = handle
+                    char name[HOSTFS_NAME_MAX];
+                    int h = guest_string(cpu, cpu->registers[1], name, sizeof(name))
+                        ? hostfs_open(fs, name, cpu->registers[2]) : -1;
+                    cpu->registers[0] = h >= 0 ? (uint16_t)h : 0;
+                    ok = h >= 0;
+                    break;
+                }
+                case 0x02: { // Close: BX = handle
+                    ok = hostfs_close(fs, cpu->registers[1]) == 0;
+                    break;
+                }
+                case 0x03:   // Read: BX = handle, CX = length, DX = buffer -> AX = bytes
+                case 0x04: { // Write: same registers
+                    uint16_t len = cpu->registers[2], buf = cpu->registers[3];
+                    long n = -1;
+                    if (guest_range_ok(cpu, buf, len)) {
+                        uint8_t* mem = (uint8_t*)cpu->memory + buf;
+                        n = (func == 0x03) ? hostfs_read(fs, cpu->registers[1], mem, len)
+                                           : hostfs_write(fs, cpu->registers[1], mem, len);
+                    }
+                    cpu->registers[0] = n > 0 ? (uint16_t)n : 0;
+                    ok = n >= 0;
+                    break;
+                }
+                case 0x05: { // Seek: BX = handle, CX:DX = offset (CX high, signed), AH = whence -> CX:DX = position
+                    int32_t offset = (int32_t)(((uint32_t)cpu->registers[2] << 16) | cpu->registers[3]);
+                    int64_t pos = hostfs_seek(fs, cpu->registers[1], offset, cpu->registers[0] >> 8);
+                    if (pos >= 0) {
+                        cpu->registers[2] = (uint16_t)(pos >> 16);
+                        cpu->registers[3] = (uint16_t)pos;
+                    }
+                    ok = pos >= 0;
+                    break;
+                }
+                case 0x06: { // Readdir: BX = index, DX = name buffer -> AX = name length, BX:CX = size
+                    char name[HOSTFS_NAME_MAX];
+                    uint64_t size = 0;
+                    uint16_t buf = cpu->registers[3];
+                    if (!guest_range_ok(cpu, buf, sizeof(name))) {
+                        break;
+                    }
+                    if (hostfs_readdir(fs, cpu->registers[1], name, sizeof(name), &size) == 0) {
+                        size_t len = strlen(name);
+                        memcpy((uint8_t*)cpu->memory + buf, name, len + 1);
+                        if (size > 0xFFFFFFFFu) size = 0xFFFFFFFFu;
+                        cpu->registers[0] = (uint16_t)len;
+                        cpu->registers[1] = (uint16_t)(size >> 16);
+                        cpu->registers[2] = (uint16_t)size;
+                        ok = 1;
+                    }
+                    break;
+                }
+                case 0x07: { // Status
+                    cpu->registers[0] = (uint16_t)hostfs_status(fs);
+                    ok = cpu->registers[0] == 0;
+                    break;
+                }
+            }
+            cpu->zero_flag = ok ? 0 : 1;
+            break;
+        }
     }
     cpu->interrupt = 0;
 }
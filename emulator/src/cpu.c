@@ -1,4 +1,5 @@
 #include "cpu.h"
+#include "executable.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,39 +24,219 @@ CPU* cpu_init(size_t memory_size, size_t stack_size) {
 }
 
 void cpu_cleanup(CPU* cpu) {
+    free(cpu->profile);
     free(cpu->memory);
     free(cpu);
 }
 
-void cpu_load_program(CPU* cpu, const char* filename) {
+static void cpu_start_program(CPU* cpu, size_t file_size, uint16_t entry) {
+    cpu->pc = entry / sizeof(uint16_t);
+   
+    // Рассчитываем размер программы в словах от начала памяти
+    size_t total_words = cpu->memory_size; // Вся доступная память
+    cpu->program_size = total_words;
+   
+    cpu_reset_vectors(cpu);
+    cpu->irq_active = 0;
+    if (cpu->profile) memset(cpu->profile, 0, cpu->memory_size * sizeof(uint64_t));
+
+    printf("Program loaded: file_size=%zu bytes, PC=0x%04x (%u words), code=0x%04zx-0x%04zx\n",
+           file_size, entry, cpu->pc, cpu->code_start * 2, cpu->code_end * 2);
+}
+
+static int is_executable(const uint8_t* image, size_t size) {
+    uint32_t magic = 0;
+    if (size >= sizeof(ExeHeader)) memcpy(&magic, image, sizeof(magic));
+    return magic == EXE_MAGIC;
+}
+
+// Reads and validates an executable's header and segment table.
+static int exe_check(CPU* cpu, const uint8_t* image, size_t size, ExeHeader* out, ExeSegment* segs) {
+    size_t max = cpu->memory_size * sizeof(uint16_t);
+    ExeHeader hdr;
+    memcpy(&hdr, image, sizeof(hdr));
+    size_t table = sizeof(hdr) + (size_t)hdr.nsegments * sizeof(ExeSegment);
+    if (hdr.version != EXE_VERSION || hdr.nsegments > EXE_MAX_SEGMENTS) {
+        printf("Error: Unsupported executable (version %u, %u segments)!\n", hdr.version, hdr.nsegments);
+        return -1;
+    }
+    if (table > size) {
+        printf("Error: Executable truncated (%zu bytes)!\n", size);
+        return -1;
+    }
+    memcpy(segs, image + sizeof(hdr), (size_t)hdr.nsegments * sizeof(ExeSegment));
+    size_t offset = table;
+    for (int i = 0; i < hdr.nsegments; i++) {
+        if ((uint64_t)segs[i].addr + segs[i].size > max || segs[i].size > size - offset) {
+            printf("Error: Segment %d (0x%04x, %u bytes) is outside memory or the file!\n", i, segs[i].addr, segs[i].size);
+            return -1;
+        }
+        offset += segs[i].size;
+    }
+    if ((uint64_t)hdr.bss_base + hdr.bss_size > max || hdr.entry >= max) {
+        printf("Error: BSS or entry point outside memory!\n");
+        return -1;
+    }
+    *out = hdr;
+    return 0;
+}
+
+// Loads an executable (see executable.h): zeroes the BSS range, then copies
+// each segment to its load address. Nothing outside them is touched.
+static int cpu_load_executable(CPU* cpu, const uint8_t* image, size_t size) {
+    ExeHeader hdr;
+    ExeSegment segs[EXE_MAX_SEGMENTS];
+    if (exe_check(cpu, image, size, &hdr, segs) != 0) return -1;
+    size_t offset = sizeof(hdr) + (size_t)hdr.nsegments * sizeof(ExeSegment);
+
+    memset((uint8_t*)cpu->memory + hdr.bss_base, 0, hdr.bss_size);
+    cpu->code_start = cpu->code_end = hdr.entry / sizeof(uint16_t);
+    for (int i = 0; i < hdr.nsegments; i++) {
+        memcpy((uint8_t*)cpu->memory + segs[i].addr, image + offset, segs[i].size);
+        offset += segs[i].size;
+        if ((segs[i].flags & EXE_TEXT) && hdr.entry >= segs[i].addr && hdr.entry < segs[i].addr + segs[i].size) {
+            cpu->code_start = segs[i].addr / sizeof(uint16_t);
+            cpu->code_end = (segs[i].addr + segs[i].size) / sizeof(uint16_t);
+        }
+    }
+    cpu_start_program(cpu, size, (uint16_t)hdr.entry);
+    return 0;
+}
+
+// Returns 0 on success; the CPU is left untouched on failure.
+int cpu_load_program(CPU* cpu, const char* filename) {
     FILE* file = fopen(filename, "rb");
     if (!file) {
         printf("Error: Failed to open binary file %s! (errno: %s)\n", filename, strerror(errno));
-        return;
+        return -1;
     }
     fseek(file, 0, SEEK_END);
     size_t file_size = ftell(file);
     fseek(file, 0, SEEK_SET);
     
-    // Читаем бинарный файл в память, начиная с адреса 0
-    uint8_t* cpu_bytes = (uint8_t*)cpu->memory;
-    size_t read = fread(cpu_bytes, 1, file_size, file);
+    uint8_t* image = (uint8_t*)malloc(file_size + 1);
+    if (!image) {
+        printf("Error: Failed to allocate %zu bytes for %s!\n", file_size, filename);
+        fclose(file);
+        return -1;
+    }
+    size_t read = fread(image, 1, file_size, file);
     fclose(file);
     if (read != file_size) {
         printf("Error: Read %zu bytes, expected %zu from %s!\n", read, file_size, filename);
-        return;
+        free(image);
+        return -1;
     }
-   
+    int ret = cpu_load_image(cpu, image, file_size);
+    free(image);
+    return ret;
+}
+
+// Returns 0 if cpu_load_image would accept the image. Touches nothing, so
+// callers can check before they tear down state tied to the running program.
+int cpu_check_image(CPU* cpu, const uint8_t* image, size_t size) {
+    if (is_executable(image, size)) {
+        ExeHeader hdr;
+        ExeSegment segs[EXE_MAX_SEGMENTS];
+        return exe_check(cpu, image, size, &hdr, segs);
+    }
+    size_t max = cpu->memory_size * sizeof(uint16_t);
+    if (size > max) {
+        printf("Error: Program image (%zu bytes) exceeds memory (%zu bytes)!\n", size, max);
+        return -1;
+    }
+    return 0;
+}
+
+// Loads an in-memory program image (e.g. a cached mapping). Executables are
+// split into segments; anything else is a flat image copied to address 0
+// and started at 0x1000. Images are validated before anything is copied, so
+// on failure (-1) the CPU and the running program are left untouched.
+int cpu_load_image(CPU* cpu, const uint8_t* image, size_t size) {
+    if (is_executable(image, size)) return cpu_load_executable(cpu, image, size);
+    if (cpu_check_image(cpu, image, size) != 0) return -1;
     // Устанавливаем начальный PC на адрес .org (0x1000) в байтах
     uint16_t org_address = 0x1000;
-    cpu->pc = org_address / sizeof(uint16_t); // Конвертируем байты в слова (2048)
-   
-    // Рассчитываем размер программы в словах от начала памяти
-    size_t total_words = cpu->memory_size; // Вся доступная память
-    cpu->program_size = total_words;
-   
-    printf("Program loaded: file_size=%zu bytes, PC=0x%04x (%u words), program_size=%zu words\n",
-           file_size, org_address, cpu->pc, cpu->program_size);
+    memcpy(cpu->memory, image, size);
+    cpu->code_start = org_address / sizeof(uint16_t);
+    cpu->code_end = cpu->memory_size;
+    cpu_start_program(cpu, size, org_address);
+    return 0;
+}
+
+void cpu_reset_vectors(CPU* cpu) {
+    for (uint16_t n = 0; n < IVT_ENTRIES; n++) {
+        cpu->memory[IVT_BASE / sizeof(uint16_t) + n] = IVT_NATIVE | n;
+    }
+}
+
+// Dispatches INT n through the vector table. BIOS defaults are handed to the
+// native service via cpu->interrupt; guest handlers are entered like a CALL
+// and return with RET. Returns 1 if control was transferred to the guest.
+int cpu_raise_interrupt(CPU* cpu, uint16_t n) {
+    uint16_t vector = (n < IVT_ENTRIES) ? cpu->memory[IVT_BASE / sizeof(uint16_t) + n] : 0;
+    if (vector == 0 || vector >= IVT_NATIVE) {
+        cpu->interrupt = n;
+        return 0;
+    }
+    uint16_t target_pc = vector / sizeof(uint16_t);
+    if (target_pc >= cpu->program_size) {
+        printf("Error: INT %u vector 0x%04x out of bounds!\n", n, vector);
+        cpu->running = 0;
+        return 0;
+    }
+    if (cpu->sp <= cpu->memory_size) {
+        printf("Error: Stack overflow on INT %u!\n", n);
+        cpu->running = 0;
+        return 0;
+    }
+    cpu->sp--;
+    cpu->memory[cpu->sp] = cpu->pc;
+    cpu->pc = target_pc;
+    return 1;
+}
+
+// Delivers an asynchronous (device) interrupt between instructions. Unlike INT,
+// the flags are pushed above the return PC and the handler must end with IRET.
+// Returns 1 if delivered, 0 if the vector is a BIOS default (nothing to run),
+// -1 if it cannot be taken right now (handler already active or stack full).
+int cpu_raise_irq(CPU* cpu, uint16_t n) {
+    uint16_t vector = (n < IVT_ENTRIES) ? cpu->memory[IVT_BASE / sizeof(uint16_t) + n] : 0;
+    if (vector == 0 || vector >= IVT_NATIVE) return 0;
+    if (!cpu->running || cpu->irq_active || cpu->sp <= cpu->memory_size + 1) return -1;
+    uint16_t target_pc = vector / sizeof(uint16_t);
+    if (target_pc >= cpu->program_size) return 0;
+    cpu->sp--;
+    cpu->memory[cpu->sp] = cpu->pc;
+    cpu->sp--;
+    cpu->memory[cpu->sp] = (uint16_t)((cpu->zero_flag ? 1 : 0) | (cpu->carry_flag ? 2 : 0) | (cpu->sign_flag ? 4 : 0));
+    cpu->pc = target_pc;
+    cpu->irq_active = 1;
+    return 1;
+}
+
+// Counts every instruction fetch by address until cleanup. Loading a program
+// starts the counts over, so the profile covers the last program run.
+int cpu_profile_start(CPU* cpu) {
+    if (!cpu->profile) cpu->profile = (uint64_t*)calloc(cpu->memory_size, sizeof(uint64_t));
+    return cpu->profile ? 0 : -1;
+}
+
+// Writes "address count" lines, byte addresses in hex, for every address that ran.
+int cpu_profile_write(CPU* cpu, const char* path) {
+    if (!cpu->profile) return -1;
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        printf("Error: Failed to write profile %s! (errno: %s)\n", path, strerror(errno));
+        return -1;
+    }
+    uint64_t total = 0;
+    for (size_t i = 0; i < cpu->memory_size; i++) total += cpu->profile[i];
+    fprintf(out, "# Corx16 profile: %llu instruction(s)\n", (unsigned long long)total);
+    for (size_t i = 0; i < cpu->memory_size; i++) {
+        if (cpu->profile[i]) fprintf(out, "0x%04zX %llu\n", i * sizeof(uint16_t), (unsigned long long)cpu->profile[i]);
+    }
+    return fclose(out) == 0 ? 0 : -1;
 }
 
 uint8_t cpu_read_byte(CPU* cpu, uint16_t address) {
@@ -83,6 +264,7 @@ void cpu_execute_instruction(CPU* cpu) {
     }
     
     uint16_t instruction = cpu->memory[cpu->pc];
+    if (cpu->profile) cpu->profile[cpu->pc]++;
     
     // Проверяем, что инструкция не равна 0 (возможно конец программы)
     if (instruction == 0) {
@@ -106,6 +288,19 @@ void cpu_execute_instruction(CPU* cpu) {
         }
         value = cpu->memory[cpu->pc + 1]; // Следующее слово — значение
         cpu->pc++;
+    } else if (mode >= MODE_SHORT_BRANCH) {
+        // One-word jump: 9-bit signed word offset from the next instruction, run as mode 5
+        int offset = (((instruction >> 5) & 0x3F) << 3) | (instruction & 7);
+        if (offset & 0x100) offset -= 0x200;
+        value = (uint16_t)((cpu->pc + 1 + offset) * sizeof(uint16_t));
+        reg1 = 0;
+        mode = 5;
+    } else if (mode >= MODE_SHORT_IMM) {
+        // One-word reg, imm: 6-bit signed immediate, run as mode 3
+        int imm = (((instruction >> 5) & 7) << 3) | (instruction & 7);
+        if (imm & 0x20) imm -= 0x40;
+        value = (uint16_t)imm;
+        mode = 3;
     } else if (is_reg2) {
         reg2 = (instruction >> 5) & 0x7; // 3 бита для второго регистра
     }
@@ -417,7 +612,7 @@ void cpu_execute_instruction(CPU* cpu) {
             break;
         case 20: // INT
             if (mode == 5) {
-                cpu->interrupt = value;
+                cpu_raise_interrupt(cpu, value);
             } else {
                 printf("Error: Invalid INT mode %u at PC %u!\n", mode, cpu->pc - 1);
                 cpu->running = 0;
@@ -566,6 +761,24 @@ void cpu_execute_instruction(CPU* cpu) {
                 cpu->running = 0;
             }
             break;
+        case 30: // IRET
+            if (mode == 0) {
+                if (cpu->sp < cpu->memory_size + cpu->stack_size - 1) {
+                    uint16_t flags = cpu->memory[cpu->sp++];
+                    cpu->pc = cpu->memory[cpu->sp++];
+                    cpu->zero_flag = (flags & 1) ? 1 : 0;
+                    cpu->carry_flag = (flags & 2) ? 1 : 0;
+                    cpu->sign_flag = (flags & 4) ? 1 : 0;
+                    cpu->irq_active = 0;
+                } else {
+                    printf("Error: Stack empty on IRET!\n");
+                    cpu->running = 0;
+                }
+            } else {
+                printf("Error: Invalid IRET mode %u at PC %u!\n", mode, cpu->pc - 1);
+                cpu->running = 0;
+            }
+            break;
         default:
             printf("Error: Unknown opcode %u at PC %u!\n", opcode, cpu->pc - 1);
             cpu->running = 0;
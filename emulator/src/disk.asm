@@ -25,8 +25,9 @@ disk_create_ok:
 
     ; Test disk: write data
     mov ax, 0x02        ; Interrupt 10, function 0x02 (write)
-    mov bx, write_data  ; Data address
+    mov bx, 0           ; Disk address
     mov cx, 13          ; Length of write_data (including null)
+    mov dx, write_data  ; Data address
     int 10              ; Trigger disk interrupt
     jz disk_write_ok    ; Jump if successful
     jmp disk_error
@@ -39,8 +40,9 @@ disk_write_ok:
 
     ; Test disk: read data
     mov ax, 0x01        ; Interrupt 10, function 0x01 (read)
-    mov bx, read_buffer ; Buffer address
+    mov bx, 0           ; Disk address
     mov cx, 13          ; Length to read
+    mov dx, read_buffer ; Buffer address
     int 10              ; Trigger disk interrupt
     jz disk_read_ok     ; Jump if successful
     jmp disk_error
@@ -1,193 +1,2399 @@
+#define _GNU_SOURCE
 #include "disk.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <signal.h>
+#include <limits.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define DISK_HAVE_URING 1
+#endif
+#endif
 
 #define BUFFER_SIZE 4096
-#define MAX_FILES 128
-#define FILE_ENTRY_SIZE 64
-#define DIR_OFFSET 1024
+#define DIR_INITIAL_ENTRIES 128
+#define FILE_ENTRY_SIZE 128
+#define NO_BLOCK ((uint32_t)-1)
+
+// Image layout: the first FS_RAW_SIZE bytes are a raw area addressed directly
+// by INT 10 functions 0x01/0x02. The file system follows in BUFFER_SIZE
+// blocks: superblock, free-space bitmap, directory, then file data.
+#define FS_MAGIC 0x58524F43     // "CORX"
+#define FS_VERSION 2
+#define FS_RAW_SIZE DISK_RAW_SIZE
+#define FS_EXTENTS 6            // Extents per file before it is relocated into one run
+#define OLD_DIR_OFFSET 1024     // Directory location before the file system existed
+
+#define JOURNAL_MAGIC 0x4C4E524A            // "JRNL"
+#define JOURNAL_GROUP_BYTES (256 * 1024)    // Commit early once a transaction grows this large
+#define JOURNAL_CHECKPOINT_BYTES (16 * 1024 * 1024)
+
+#define COW_MAGIC 0x574F4344                // "DCOW"
+#define COW_VERSION 1
+#define COW_MAP_OFFSET BUFFER_SIZE          // Block map follows the header block
+#define COW_MAP_BYTES (DISK_MAX_SIZE / BUFFER_SIZE / 8)
+#define COW_DATA_OFFSET ((off_t)(COW_MAP_OFFSET + COW_MAP_BYTES))
+
+enum { XFER_READ, XFER_WRITE, XFER_LOG };   // fs_transfer modes
+
+typedef struct {
+    uint32_t start;             // First block
+    uint32_t count;
+} Extent;
 
 typedef struct {
     char name[MAX_FILENAME];
-    uint32_t start_addr;
-    uint32_t size;
+    uint32_t size;              // Bytes; the extents may hold more (growth slack)
+    uint32_t extent_count;
+    Extent extents[FS_EXTENTS];
+    uint8_t reserved[FILE_ENTRY_SIZE - MAX_FILENAME - 8 - FS_EXTENTS * sizeof(Extent)];
 } FileEntry;
+_Static_assert(sizeof(FileEntry) == FILE_ENTRY_SIZE, "FileEntry must match the on-disk entry size");
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t total_blocks;
+    uint32_t bitmap_start;      // Block numbers from here on
+    uint32_t bitmap_blocks;
+    uint32_t dir_start;         // Initial directory region, reserved at format time
+    uint32_t dir_blocks;
+    uint32_t data_start;
+    uint32_t free_blocks;
+    FileEntry dir;              // Extents of the directory (version 2+); starts at dir_start
+} Superblock;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t len;               // Payload bytes (records) following the header
+    uint32_t crc;               // CRC-32 of the payload
+} JournalHeader;
+
+typedef struct {
+    uint32_t addr;
+    uint32_t len;               // Followed by len bytes of data
+} JournalRecord;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t reserved;
+    uint64_t base_size;         // Base size and mtime at creation or last commit
+    int64_t base_mtime_sec;
+    int64_t base_mtime_nsec;
+    char base_path[BUFFER_SIZE - 40];   // Absolute
+} CowHeader;
+_Static_assert(sizeof(CowHeader) == BUFFER_SIZE, "CowHeader must fill one block");
+
+typedef struct {
+    uint16_t id;
+    int write;
+    uint32_t addr;
+    size_t len;
+    uint8_t* data;
+    uint16_t status;
+} DiskRequest;
+
+typedef struct {
+    uint32_t addr;              // Block address on disk, NO_BLOCK if unused
+    int dirty;
+    int prev, next;             // LRU list, most recently used at lru_head
+    int hnext;                  // Hash bucket chain
+    uint8_t* data;
+} CachePage;
+
+// io_uring rings mapped from the kernel, DISK_BACKEND_URING only.
+typedef struct {
+    int fd;                     // -1 when not in use
+    unsigned entries;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    void* sqes;                 // struct io_uring_sqe[entries]
+    void* cqes;                 // struct io_uring_cqe[], inside cq_map
+    void* sq_map;
+    void* cq_map;               // Same as sq_map with IORING_FEAT_SINGLE_MMAP
+    size_t sq_map_len, cq_map_len, sqes_len;
+} DiskRing;
 
 struct Disk {
-    FILE* file;
+    pthread_mutex_t lock;       // Serializes buffer/directory access between callers and the worker
+    int fd;
+    uint64_t size;              // Image size in bytes, a multiple of BUFFER_SIZE
+    DiskBackend backend;
+    uint8_t* map;               // Whole image, DISK_BACKEND_MMAP only
     uint16_t last_error;
-    uint8_t buffer[BUFFER_SIZE];
-    uint32_t buffer_addr;
-    int buffer_dirty;
-    FileEntry files[MAX_FILES];
+
+    // Page cache, DISK_BACKEND_BUFFERED and DISK_BACKEND_URING
+    CachePage* pages;
+    int npages;
+    uint8_t* page_mem;
+    int* buckets;
+    uint32_t nbuckets;
+    int lru_head, lru_tail;
+    uint32_t last_block;        // Previous block accessed, for sequential detection
+    int ra_window;              // Current readahead window in blocks
+    int readahead_max;
+    DiskRing ring;
+
+    // File system
+    Superblock sb;
+    uint64_t* bitmap;           // One bit per block, set = allocated
+    uint32_t alloc_cursor;      // Next-fit allocation position
+    FileEntry* files;           // Directory, dir_capacity entries
+    uint32_t dir_capacity;
     int file_count;
+    int* name_buckets;          // Name hash index: bucket heads
+    int* name_next;             // Chain link per directory entry
+    uint32_t name_nbuckets;
+    int* free_slots;            // Stack of unused directory entries
+    int free_count;
+    uint8_t* bitmap_dirty;      // Per bitmap block, logged at the next commit
+    uint8_t* dir_dirty;         // Per directory block
+
+    // Write-ahead journal, see journal_commit
+    int journal_fd;             // -1 if unavailable; metadata is then stored unlogged
+    uint64_t journal_off;       // End of committed transactions
+    uint32_t journal_seq;
+    uint8_t* txn;               // Open transaction: JournalRecords
+    size_t txn_len, txn_cap;
+    int txn_open;
+    struct timespec txn_deadline;
+    int commit_ms;
+
+    // Overlay images, see cow_open
+    int base_fd;                // Read-only base image, -1 if this is not an overlay
+    char* base_path;
+    uint64_t base_size;
+    uint8_t* cow_map;           // One bit per block, set = the block lives in the overlay
+    uint8_t cow_dirty[COW_MAP_BYTES / BUFFER_SIZE];
+
+    DiskMetrics metrics;
+    int trace;                  // Log every transfer to stdout
+
+    // Asynchronous requests: submitted -> queue -> worker -> done -> disk_poll
+    pthread_t worker;
+    pthread_cond_t wake;
+    int worker_running;
+    int stopping;
+    DiskRequest queue[DISK_QUEUE_DEPTH];
+    int queue_head, queue_count;
+    DiskRequest done[DISK_QUEUE_DEPTH];
+    int done_head, done_count;
+    int outstanding;
+    uint16_t next_id;
+    unsigned completed;
 };
 
+static int disk_read_locked(Disk* disk, uint32_t addr, size_t len, uint8_t* data);
+static int disk_write_locked(Disk* disk, uint32_t addr, size_t len, const uint8_t* data);
+static int disk_create_file_locked(Disk* disk, const char* filename);
+static int disk_delete_file_locked(Disk* disk, const char* filename);
+static void cache_init(Disk* disk, int npages, int readahead);
+static void cache_free(Disk* disk);
+static int cow_open(Disk* disk, const char* path, const char* base_path, const char* journal_path);
+static int cow_save_map(Disk* disk);
+static int image_pread(Disk* disk, uint8_t* buf, size_t len, off_t off);
+static int image_pwrite(Disk* disk, const uint8_t* buf, size_t len, off_t off);
+static int ring_init(DiskRing* r, unsigned entries);
+static void ring_free(DiskRing* r);
+static int cache_writeback(Disk* disk, int sync);
+static int disk_load(Disk* disk, uint32_t addr, size_t len, uint8_t* data);
+static int disk_store(Disk* disk, uint32_t addr, size_t len, const uint8_t* data);
+static void disk_flush_locked(Disk* disk);
+static void fs_mount(Disk* disk);
+static void fs_log_meta(Disk* disk);
+static void journal_commit(Disk* disk);
+static void journal_checkpoint(Disk* disk);
+static void journal_replay(Disk* disk);
+static void disk_sync_image(Disk* disk);
+static uint64_t now_ns(void);
+static void metrics_op(Disk* disk, DiskOp op, uint64_t start_ns, size_t bytes);
+
+static void disk_complete(Disk* disk, DiskRequest* req) {
+    disk->done[(disk->done_head + disk->done_count) % DISK_QUEUE_DEPTH] = *req;
+    disk->done_count++;
+    __atomic_add_fetch(&disk->completed, 1, __ATOMIC_RELEASE);
+}
+
+static void* disk_worker(void* arg) {
+    Disk* disk = (Disk*)arg;
+    pthread_mutex_lock(&disk->lock);
+    for (;;) {
+        while (disk->queue_count == 0 && !disk->stopping) {
+            if (!disk->txn_open) {
+                pthread_cond_wait(&disk->wake, &disk->lock);
+            } else if (pthread_cond_timedwait(&disk->wake, &disk->lock, &disk->txn_deadline) == ETIMEDOUT) {
+                journal_commit(disk);
+            }
+        }
+        if (disk->queue_count == 0) break;
+        DiskRequest req = disk->queue[disk->queue_head];
+        disk->queue_head = (disk->queue_head + 1) % DISK_QUEUE_DEPTH;
+        disk->queue_count--;
+        if (req.write) disk_write_locked(disk, req.addr, req.len, req.data);
+        else disk_read_locked(disk, req.addr, req.len, req.data);
+        req.status = disk->last_error;
+        disk_complete(disk, &req);
+    }
+    pthread_mutex_unlock(&disk->lock);
+    return NULL;
+}
+
+// Reads exactly `len` bytes at `off`; bytes past the end of the image read as zero.
+static int disk_pread_full(int fd, uint8_t* buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) { memset(buf, 0, len); return 0; }
+        buf += n; len -= (size_t)n; off += n;
+    }
+    return 0;
+}
+
+static int disk_pwrite_full(int fd, const uint8_t* buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n; len -= (size_t)n; off += n;
+    }
+    return 0;
+}
+
+// Copies `src` into `dst`: a reflink where the filesystem supports it,
+// otherwise copy_file_range, otherwise a plain read/write loop.
+static int disk_clone_file(int dst, int src) {
+#ifdef FICLONE
+    if (ioctl(dst, FICLONE, src) == 0) return 0;
+#endif
+    struct stat st;
+    if (fstat(src, &st) != 0) return -1;
+    off_t done = 0;
+#ifdef __linux__
+    while (done < st.st_size) {
+        ssize_t n = copy_file_range(src, NULL, dst, NULL, (size_t)(st.st_size - done), 0);
+        if (n <= 0) break;
+        done += n;
+    }
+    if (done == st.st_size) return 0;
+#endif
+    uint8_t buf[BUFFER_SIZE * 16];
+    while (done < st.st_size) {
+        ssize_t n = pread(src, buf, sizeof(buf), done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        if (disk_pwrite_full(dst, buf, (size_t)n, done) != 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Creates a disk image of `size` bytes without writing its contents: sparse
+// via ftruncate, or fully allocated via posix_fallocate when `preallocate` is
+// set. With a template the image starts as a clone of it. The image is built
+// under a temporary name and renamed into place, so concurrent openers never
+// see a partial image. Returns 0 on success.
+int disk_create_image(const char* path, uint64_t size, const char* template_path, int preallocate) {
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+
+    int ok = 1;
+    if (template_path) {
+        int src = open(template_path, O_RDONLY | O_CLOEXEC);
+        ok = (src >= 0 && disk_clone_file(fd, src) == 0);
+        if (src >= 0) close(src);
+    }
+    struct stat st;
+    if (ok && fstat(fd, &st) == 0 && (uint64_t)st.st_size < size) {
+        ok = (ftruncate(fd, (off_t)size) == 0);
+    }
+    if (ok && preallocate) {
+        ok = (posix_fallocate(fd, 0, (off_t)size) == 0);
+    }
+    close(fd);
+    if (!ok || rename(tmp, path) != 0) {
+        int saved = errno;
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+// Parses a byte count with an optional K/M/G suffix. Returns 0 on bad input.
+uint64_t disk_parse_size(const char* s) {
+    char* end;
+    unsigned long long v = strtoull(s, &end, 0);
+    switch (*end) {
+        case 'k': case 'K': v <<= 10; end++; break;
+        case 'm': case 'M': v <<= 20; end++; break;
+        case 'g': case 'G': v <<= 30; end++; break;
+    }
+    return *end ? 0 : (uint64_t)v;
+}
+
+void disk_default_options(DiskOptions* opts) {
+    opts->path = DISK_FILE;
+    opts->backend = DISK_BACKEND_MMAP;
+
+    const char* env = getenv("CORX_DISK_IMAGE");
+    if (env && *env) opts->path = env;
+    env = getenv("CORX_DISK_BACKEND");
+    if (env && strcmp(env, "buffered") == 0) opts->backend = DISK_BACKEND_BUFFERED;
+    else if (env && strcmp(env, "uring") == 0) opts->backend = DISK_BACKEND_URING;
+    else if (env && strcmp(env, "mmap") == 0) opts->backend = DISK_BACKEND_MMAP;
+    opts->template_path = getenv("CORX_DISK_TEMPLATE");
+    opts->base_path = getenv("CORX_DISK_BASE");
+    env = getenv("CORX_DISK_PREALLOCATE");
+    opts->preallocate = (env && atoi(env) != 0);
+    opts->cache_pages = DISK_CACHE_PAGES;
+    env = getenv("CORX_DISK_CACHE_PAGES");
+    if (env && atoi(env) > 0) opts->cache_pages = atoi(env);
+    opts->readahead = DISK_MAX_READAHEAD;
+    env = getenv("CORX_DISK_READAHEAD");
+    if (env) {
+        char* end;
+        long ra = strtol(env, &end, 10);
+        if (end != env && !*end && ra >= 0 && ra <= DISK_MAX_READAHEAD) opts->readahead = (int)ra;
+    }
+    opts->size = DISK_SIZE;
+    env = getenv("CORX_DISK_SIZE");
+    if (env && disk_parse_size(env) >= DISK_SIZE) opts->size = disk_parse_size(env);
+    env = getenv("CORX_DISK_TRACE");
+    opts->trace = (env && atoi(env) != 0);
+    opts->commit_ms = DISK_COMMIT_MS;
+    env = getenv("CORX_DISK_COMMIT_MS");
+    if (env && atoi(env) >= 0) opts->commit_ms = atoi(env);
+}
+
 Disk* disk_init(void) {
+    DiskOptions opts;
+    disk_default_options(&opts);
+    return disk_open(&opts);
+}
+
+Disk* disk_open(const DiskOptions* opts) {
     Disk* disk = (Disk*)calloc(1, sizeof(Disk));
     if (!disk) {
         fprintf(stderr, "Error: Failed to allocate memory for disk!\n");
         exit(1);
     }
 
-    disk->file = fopen(DISK_FILE, "r+b");
-    if (!disk->file) {
-        disk->file = fopen(DISK_FILE, "w+b");
-        if (!disk->file) {
-            fprintf(stderr, "Error: Failed to create disk.img: %s\n", strerror(errno));
+    char journal_path[512];
+    snprintf(journal_path, sizeof(journal_path), "%s.journal", opts->path);
+    off_t data_off = 0;
+    disk->base_fd = -1;
+    if (opts->base_path) {
+        if (cow_open(disk, opts->path, opts->base_path, journal_path) != 0) exit(1);
+        data_off = COW_DATA_OFFSET;
+    } else {
+        disk->fd = open(opts->path, O_RDWR | O_CLOEXEC);
+    }
+    if (disk->fd < 0 && errno == ENOENT && !opts->base_path) {
+        unlink(journal_path); // Left over from a deleted image; must not replay onto the new one
+        if (disk_create_image(opts->path, opts->size, opts->template_path, opts->preallocate) != 0) {
+            fprintf(stderr, "Error: Failed to create %s: %s\n", opts->path, strerror(errno));
             free(disk);
             exit(1);
         }
-        uint8_t zero = 0;
-        for (size_t i = 0; i < DISK_SIZE; i++) {
-            fwrite(&zero, 1, 1, disk->file);
-        }
+        disk->fd = open(opts->path, O_RDWR | O_CLOEXEC);
+    }
+    struct stat st;
+    if (disk->fd < 0 || fstat(disk->fd, &st) != 0) {
+        fprintf(stderr, "Error: Failed to open %s: %s\n", opts->path, strerror(errno));
+        free(disk);
+        exit(1);
+    }
+    // An existing image keeps its size unless a larger one was requested.
+    uint64_t image_size = (uint64_t)(st.st_size - data_off);
+    disk->size = image_size > opts->size ? image_size : opts->size;
+    if (disk->size > DISK_MAX_SIZE) disk->size = DISK_MAX_SIZE;
+    disk->size -= disk->size % BUFFER_SIZE;
+    if (image_size < disk->size && ftruncate(disk->fd, data_off + (off_t)disk->size) != 0) {
+        fprintf(stderr, "Error: Failed to extend %s: %s\n", opts->path, strerror(errno));
+        close(disk->fd);
+        free(disk);
+        exit(1);
     }
 
-    // Load file system
-    fseek(disk->file, DIR_OFFSET, SEEK_SET);
-    fread(disk->files, sizeof(FileEntry), MAX_FILES, disk->file);
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (disk->files[i].name[0] != '\0') {
-            disk->file_count++;
+    disk->backend = opts->backend;
+    if (disk->backend == DISK_BACKEND_MMAP && disk->base_fd >= 0) {
+        disk->backend = DISK_BACKEND_BUFFERED;  // Blocks come from two files; only the cache can merge them
+    }
+    if (disk->backend == DISK_BACKEND_MMAP) {
+        void* map = mmap(NULL, (size_t)disk->size, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Disk: mmap failed (%s), using buffered I/O\n", strerror(errno));
+            disk->backend = DISK_BACKEND_BUFFERED;
+        } else {
+            disk->map = (uint8_t*)map;
         }
     }
 
-    disk->buffer_addr = (uint32_t)-1;
-    disk->buffer_dirty = 0;
+    if (!disk->map) cache_init(disk, opts->cache_pages, opts->readahead);
+    disk->ring.fd = -1;
+    if (disk->backend == DISK_BACKEND_URING && ring_init(&disk->ring, DISK_RING_ENTRIES) != 0) {
+        fprintf(stderr, "Disk: io_uring unavailable (%s), using buffered I/O\n", strerror(errno));
+        disk->backend = DISK_BACKEND_BUFFERED;
+    }
+
+    pthread_mutex_init(&disk->lock, NULL);
+    pthread_cond_init(&disk->wake, NULL);
+
+    disk->commit_ms = opts->commit_ms;
+    disk->trace = opts->trace;
+    disk->journal_fd = open(journal_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (disk->journal_fd < 0) {
+        fprintf(stderr, "Disk: Failed to open %s (%s), running without a journal\n", journal_path, strerror(errno));
+    } else {
+        journal_replay(disk);
+    }
+    fs_mount(disk);
+
+    if (pthread_create(&disk->worker, NULL, disk_worker, disk) == 0) {
+        disk->worker_running = 1;
+    } else {
+        fprintf(stderr, "Disk: Failed to start I/O thread, async requests run synchronously\n");
+    }
     return disk;
 }
 
-void disk_flush_buffer(Disk* disk) {
-    if (disk->buffer_dirty && disk->buffer_addr != (uint32_t)-1) {
-        fseek(disk->file, disk->buffer_addr, SEEK_SET);
-        fwrite(disk->buffer, 1, BUFFER_SIZE, disk->file);
-        disk->buffer_dirty = 0;
-    }
+// Commits the open transaction, then writes back dirty pages, makes the
+// image durable and empties the journal.
+static void disk_flush_locked(Disk* disk) {
+    uint64_t start = now_ns();
+    journal_commit(disk);
+    journal_checkpoint(disk);
+    disk->metrics.flushes++;
+    metrics_op(disk, DISK_OP_FLUSH, start, 0);
+}
+
+// Without the I/O thread nothing commits when the group commit window
+// expires, so calls that change the image commit before they return.
+static void disk_commit_inline(Disk* disk) {
+    if (!disk->worker_running) journal_commit(disk);
+}
+
+void disk_cache_stats(Disk* disk, DiskCacheStats* stats) {
+    pthread_mutex_lock(&disk->lock);
+    *stats = disk->metrics.cache;
+    pthread_mutex_unlock(&disk->lock);
+}
+
+void disk_flush(Disk* disk) {
+    pthread_mutex_lock(&disk->lock);
+    disk_flush_locked(disk);
+    pthread_mutex_unlock(&disk->lock);
 }
 
 void disk_cleanup(Disk* disk) {
-    disk_flush_buffer(disk);
-    if (disk->file) {
-        fseek(disk->file, DIR_OFFSET, SEEK_SET);
-        fwrite(disk->files, sizeof(FileEntry), MAX_FILES, disk->file);
-        fclose(disk->file);
+    if (disk->worker_running) {
+        pthread_mutex_lock(&disk->lock);
+        disk->stopping = 1;
+        pthread_cond_signal(&disk->wake);
+        pthread_mutex_unlock(&disk->lock);
+        pthread_join(disk->worker, NULL);
     }
+    disk_flush_locked(disk);
+    disk_dump_metrics(disk, stderr);    // Takes the lock, so destroy it last
+    if (disk->journal_fd >= 0) close(disk->journal_fd);
+    if (disk->map) {
+        munmap(disk->map, (size_t)disk->size);
+    } else {
+        cache_free(disk);
+    }
+    if (disk->ring.fd >= 0) ring_free(&disk->ring);
+    if (disk->base_fd >= 0) close(disk->base_fd);
+    free(disk->base_path);
+    free(disk->cow_map);
+    free(disk->bitmap);
+    free(disk->files);
+    free(disk->name_buckets);
+    free(disk->name_next);
+    free(disk->free_slots);
+    free(disk->bitmap_dirty);
+    free(disk->dir_dirty);
+    free(disk->txn);
+    close(disk->fd);
+    pthread_cond_destroy(&disk->wake);
+    pthread_mutex_destroy(&disk->lock);
     free(disk);
 }
 
 int disk_read(Disk* disk, uint32_t addr, size_t len, uint8_t* data) {
-    if (addr + len > DISK_SIZE) {
-        disk->last_error = 1;
-        fprintf(stderr, "Disk read error: Address 0x%04X + %zu exceeds disk size\n", addr, len);
-        return 1;
+    pthread_mutex_lock(&disk->lock);
+    int ret = disk_read_locked(disk, addr, len, data);
+    pthread_mutex_unlock(&disk->lock);
+    return ret;
+}
+
+int disk_write(Disk* disk, uint32_t addr, size_t len, const uint8_t* data) {
+    pthread_mutex_lock(&disk->lock);
+    int ret = disk_write_locked(disk, addr, len, data);
+    disk_commit_inline(disk);
+    pthread_mutex_unlock(&disk->lock);
+    return ret;
+}
+
+// Queues a transfer for the I/O thread. `data` must stay valid until the
+// request is returned by disk_poll. Transfers are confined to the raw area so
+// guests cannot reach the file system. Returns the request id, or 0 if the
+// queue is full or the range is outside the raw area. Without a worker thread
+// the request completes before returning.
+uint16_t disk_submit(Disk* disk, int write, uint32_t addr, size_t len, uint8_t* data) {
+    if ((uint64_t)addr + len > DISK_RAW_SIZE) return 0;
+    pthread_mutex_lock(&disk->lock);
+    if (disk->outstanding >= DISK_QUEUE_DEPTH) {
+        pthread_mutex_unlock(&disk->lock);
+        return 0;
+    }
+    if (++disk->next_id == 0) disk->next_id = 1;
+    DiskRequest req = { disk->next_id, write, addr, len, data, 0 };
+    disk->outstanding++;
+    if (disk->worker_running) {
+        disk->queue[(disk->queue_head + disk->queue_count) % DISK_QUEUE_DEPTH] = req;
+        disk->queue_count++;
+        pthread_cond_signal(&disk->wake);
+    } else {
+        if (write) disk_write_locked(disk, addr, len, data);
+        else disk_read_locked(disk, addr, len, data);
+        req.status = disk->last_error;
+        disk_complete(disk, &req);
+        disk_commit_inline(disk);
     }
+    pthread_mutex_unlock(&disk->lock);
+    return req.id;
+}
 
-    size_t offset = 0;
-    while (offset < len) {
-        uint32_t block_addr = addr + offset - (addr + offset) % BUFFER_SIZE;
-        size_t block_offset = (addr + offset) % BUFFER_SIZE;
-        size_t to_read = len - offset < BUFFER_SIZE - block_offset ? len - offset : BUFFER_SIZE - block_offset;
+// Pops the oldest finished request. Returns 1 and fills id/status, or 0 if none.
+int disk_poll(Disk* disk, uint16_t* id, uint16_t* status) {
+    pthread_mutex_lock(&disk->lock);
+    if (disk->done_count == 0) {
+        pthread_mutex_unlock(&disk->lock);
+        return 0;
+    }
+    DiskRequest* req = &disk->done[disk->done_head];
+    *id = req->id;
+    *status = req->status;
+    disk->done_head = (disk->done_head + 1) % DISK_QUEUE_DEPTH;
+    disk->done_count--;
+    disk->outstanding--;
+    pthread_mutex_unlock(&disk->lock);
+    return 1;
+}
 
-        if (block_addr != disk->buffer_addr) {
-            disk_flush_buffer(disk);
-            fseek(disk->file, block_addr, SEEK_SET);
-            size_t read = fread(disk->buffer, 1, BUFFER_SIZE, disk->file);
-            if (read != BUFFER_SIZE && !feof(disk->file)) {
-                disk->last_error = 1;
-                fprintf(stderr, "Disk read error: Failed to read buffer at 0x%04X\n", block_addr);
-                return 1;
-            }
-            disk->buffer_addr = block_addr;
-        }
+// Forgets every async request of the running program before another is
+// loaded: queued ones are dropped and finished ones are never reported. The
+// worker runs each request with the lock held, so once it is taken here none
+// is in flight and nothing writes into guest memory afterwards.
+void disk_cancel_requests(Disk* disk) {
+    pthread_mutex_lock(&disk->lock);
+    disk->queue_count = 0;
+    disk->done_count = 0;
+    disk->outstanding = 0;
+    pthread_mutex_unlock(&disk->lock);
+}
 
-        memcpy(data + offset, disk->buffer + block_offset, to_read);
-        offset += to_read;
+// Total number of requests completed so far; cheap enough to call every instruction.
+unsigned disk_completed(Disk* disk) {
+    return __atomic_load_n(&disk->completed, __ATOMIC_ACQUIRE);
+}
+
+// ---------- metrics ----------
+static volatile sig_atomic_t metrics_requested;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Log-linear bucketing: values below 2^DISK_HIST_SUB_BITS get their own
+// bucket, larger ones share a power of two split into 2^DISK_HIST_SUB_BITS
+// linear steps, so every bucket is within 12.5% of its values.
+static int hist_index(uint64_t v) {
+    if (v < (1u << DISK_HIST_SUB_BITS)) return (int)v;
+    int shift = 63 - __builtin_clzll(v) - DISK_HIST_SUB_BITS;
+    return ((shift + 1) << DISK_HIST_SUB_BITS) + (int)((v >> shift) & ((1u << DISK_HIST_SUB_BITS) - 1));
+}
+
+// Highest value that falls into bucket `i`.
+static uint64_t hist_upper(int i) {
+    if (i < (1 << DISK_HIST_SUB_BITS)) return (uint64_t)i;
+    int shift = (i >> DISK_HIST_SUB_BITS) - 1;
+    uint64_t sub = (uint64_t)(i & ((1 << DISK_HIST_SUB_BITS) - 1));
+    return (((1ULL << DISK_HIST_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+static void hist_record(DiskHistogram* h, uint64_t ns) {
+    h->count++;
+    h->sum_ns += ns;
+    if (ns > h->max_ns) h->max_ns = ns;
+    h->buckets[hist_index(ns)]++;
+}
+
+// Value at quantile q (0..1), reported as the top of its bucket.
+uint64_t disk_histogram_quantile(const DiskHistogram* h, double q) {
+    if (h->count == 0) return 0;
+    uint64_t rank = (uint64_t)(q * (double)h->count + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < DISK_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) return hist_upper(i) < h->max_ns ? hist_upper(i) : h->max_ns;
     }
+    return h->max_ns;
+}
 
-    disk->last_error = 0;
-    printf("Disk read: addr=0x%04X, len=%zu\n", addr, len);
+static void metrics_op(Disk* disk, DiskOp op, uint64_t start_ns, size_t bytes) {
+    DiskMetrics* m = &disk->metrics;
+    hist_record(&m->latency[op], now_ns() - start_ns);
+    if (op == DISK_OP_READ || op == DISK_OP_FILE_READ) {
+        m->reads++;
+        m->read_bytes += bytes;
+    } else if (op == DISK_OP_WRITE || op == DISK_OP_FILE_WRITE) {
+        m->writes++;
+        m->write_bytes += bytes;
+    }
+}
+
+void disk_metrics(Disk* disk, DiskMetrics* metrics) {
+    pthread_mutex_lock(&disk->lock);
+    *metrics = disk->metrics;
+    pthread_mutex_unlock(&disk->lock);
+}
+
+static void print_ns(FILE* out, const char* label, uint64_t ns) {
+    if (ns < 10000) fprintf(out, " %s=%lluns", label, (unsigned long long)ns);
+    else if (ns < 10000000) fprintf(out, " %s=%.1fus", label, ns / 1e3);
+    else fprintf(out, " %s=%.1fms", label, ns / 1e6);
+}
+
+void disk_dump_metrics(Disk* disk, FILE* out) {
+    static const char* names[DISK_OP_COUNT] = { "read", "write", "file read", "file write", "flush", "commit" };
+    DiskMetrics m;
+    disk_metrics(disk, &m);
+    fprintf(out, "Disk metrics: %llu reads (%llu bytes), %llu writes (%llu bytes), %llu flushes, %llu syscalls\n",
+            (unsigned long long)m.reads, (unsigned long long)m.read_bytes, (unsigned long long)m.writes,
+            (unsigned long long)m.write_bytes, (unsigned long long)m.flushes, (unsigned long long)m.syscalls);
+    if (!disk->map) {
+        fprintf(out, "Disk cache: %llu hits, %llu misses, %llu readahead, %llu pages written in %llu batches, %llu blocks bypassed\n",
+                (unsigned long long)m.cache.hits, (unsigned long long)m.cache.misses, (unsigned long long)m.cache.readahead,
+                (unsigned long long)m.cache.writebacks, (unsigned long long)m.cache.writeback_batches,
+                (unsigned long long)m.cache.bypassed);
+    }
+    if (disk->journal_fd >= 0) {
+        fprintf(out, "Disk journal: %llu commits, %llu bytes\n",
+                (unsigned long long)m.journal_commits, (unsigned long long)m.journal_bytes);
+    }
+    for (int op = 0; op < DISK_OP_COUNT; op++) {
+        const DiskHistogram* h = &m.latency[op];
+        if (h->count == 0) continue;
+        fprintf(out, "  %-10s n=%llu", names[op], (unsigned long long)h->count);
+        print_ns(out, "mean", h->sum_ns / h->count);
+        print_ns(out, "p50", disk_histogram_quantile(h, 0.50));
+        print_ns(out, "p90", disk_histogram_quantile(h, 0.90));
+        print_ns(out, "p99", disk_histogram_quantile(h, 0.99));
+        print_ns(out, "p99.9", disk_histogram_quantile(h, 0.999));
+        print_ns(out, "max", h->max_ns);
+        fputc('\n', out);
+    }
+}
+
+static void metrics_signal_handler(int sig) {
+    (void)sig;
+    metrics_requested = 1;
+}
+
+// Installs a handler that requests a metrics dump; the dump itself happens in
+// disk_service_metrics, outside signal context.
+void disk_metrics_signal(int sig) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = metrics_signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(sig, &sa, NULL);
+}
+
+void disk_service_metrics(Disk* disk) {
+    if (!metrics_requested) return;
+    metrics_requested = 0;
+    disk_dump_metrics(disk, stderr);
+}
+
+// ---------- I/O submission ----------
+// Page cache and journal transfers are issued as DiskIo batches. On the uring
+// backend a batch goes to the kernel with one io_uring_enter and its entries
+// run in parallel; otherwise each entry is its own preadv/pwritev/fdatasync.
+enum { IO_READ, IO_WRITE, IO_SYNC };    // IO_SYNC waits for every earlier entry in the batch
+
+typedef struct {
+    int op;
+    int fd;
+    struct iovec* iov;
+    int iovcnt;
+    off_t off;
+    ssize_t res;                // Bytes transferred, or -errno
+} DiskIo;
+
+#define IO_PENDING ((ssize_t)INT64_MIN) // DiskIo.res until the request has run
+
+#ifdef DISK_HAVE_URING
+static void ring_free(DiskRing* r) {
+    if (r->sqes) munmap(r->sqes, r->sqes_len);
+    if (r->cq_map && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_map_len);
+    if (r->sq_map) munmap(r->sq_map, r->sq_map_len);
+    if (r->fd >= 0) close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+static int ring_init(DiskRing* r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) return -1;
+    r->entries = p.sq_entries;
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_len > r->sq_map_len) r->sq_map_len = r->cq_map_len;
+        r->cq_map_len = r->sq_map_len;
+    }
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) { r->sq_map = NULL; goto fail; }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
+    } else {
+        r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_map == MAP_FAILED) { r->cq_map = NULL; goto fail; }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) { r->sqes = NULL; goto fail; }
+
+    uint8_t* sq = (uint8_t*)r->sq_map;
+    uint8_t* cq = (uint8_t*)r->cq_map;
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = cq + p.cq_off.cqes;
     return 0;
+fail: {
+        int err = errno;
+        ring_free(r);
+        errno = err;
+        return -1;
+    }
 }
 
-int disk_write(Disk* disk, uint32_t addr, size_t len, const uint8_t* data) {
-    if (addr + len > DISK_SIZE) {
-        disk->last_error = 1;
-        fprintf(stderr, "Disk write error: Address 0x%04X + %zu exceeds disk size\n", addr, len);
-        return 1;
+// Moves finished completions into ios[].res. Returns how many were reaped.
+static int ring_reap(DiskRing* r, DiskIo* ios) {
+    struct io_uring_cqe* cqes = (struct io_uring_cqe*)r->cqes;
+    unsigned head = *r->cq_head;
+    unsigned ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    int reaped = 0;
+    for (; head != ctail; head++, reaped++) {
+        struct io_uring_cqe* cqe = &cqes[head & *r->cq_mask];
+        ios[cqe->user_data].res = cqe->res;
     }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
 
-    size_t offset = 0;
-    while (offset < len) {
-        uint32_t block_addr = addr + offset - (addr + offset) % BUFFER_SIZE;
-        size_t block_offset = (addr + offset) % BUFFER_SIZE;
-        size_t to_write = len - offset < BUFFER_SIZE - block_offset ? len - offset : BUFFER_SIZE - block_offset;
+// Submits ios[0, n), n <= ring entries, and waits until all of them complete.
+// On failure, entries that completed have their result and the rest are
+// left IO_PENDING, after waiting for any the kernel had already accepted.
+static int ring_run(Disk* disk, DiskIo* ios, int n) {
+    DiskRing* r = &disk->ring;
+    struct io_uring_sqe* sqes = (struct io_uring_sqe*)r->sqes;
+    unsigned tail = *r->sq_tail;
+    for (int i = 0; i < n; i++) {
+        unsigned idx = tail++ & *r->sq_mask;
+        struct io_uring_sqe* sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = ios[i].fd;
+        sqe->user_data = (uint64_t)i;
+        if (ios[i].op == IO_SYNC) {
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            sqe->flags = IOSQE_IO_DRAIN;
+        } else {
+            sqe->opcode = ios[i].op == IO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+            sqe->addr = (uint64_t)(uintptr_t)ios[i].iov;
+            sqe->len = (uint32_t)ios[i].iovcnt;
+            sqe->off = (uint64_t)ios[i].off;
+        }
+        r->sq_array[idx] = idx;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
 
-        if (block_addr != disk->buffer_addr) {
-            disk_flush_buffer(disk);
-            fseek(disk->file, block_addr, SEEK_SET);
-            size_t read = fread(disk->buffer, 1, BUFFER_SIZE, disk->file);
-            if (read != BUFFER_SIZE && !feof(disk->file)) {
-                disk->last_error = 1;
-                fprintf(stderr, "Disk read error: Failed to read buffer at 0x%04X\n", block_addr);
-                return 1;
+    int submitted = 0, reaped = 0;
+    while (reaped < n) {
+        int ret = (int)syscall(__NR_io_uring_enter, r->fd, (unsigned)(n - submitted), (unsigned)(n - reaped),
+                               IORING_ENTER_GETEVENTS, NULL, 0);
+        disk->metrics.syscalls++;
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            int err = errno;
+            reaped += ring_reap(r, ios);
+            while (reaped < submitted) {
+                if (syscall(__NR_io_uring_enter, r->fd, 0u, (unsigned)(submitted - reaped), IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                    errno != EINTR) break;
+                disk->metrics.syscalls++;
+                reaped += ring_reap(r, ios);
             }
-            disk->buffer_addr = block_addr;
+            errno = err;
+            return -1;
         }
+        submitted += ret;
+        reaped += ring_reap(r, ios);
+    }
+    return 0;
+}
+#else
+static void ring_free(DiskRing* r) {
+    r->fd = -1;
+}
 
-        memcpy(disk->buffer + block_offset, data + offset, to_write);
-        disk->buffer_dirty = 1;
-        offset += to_write;
+static int ring_init(DiskRing* r, unsigned entries) {
+    (void)entries;
+    r->fd = -1;
+    errno = ENOSYS;
+    return -1;
+}
+#endif
+
+static void disk_io_submit(Disk* disk, DiskIo* ios, int n) {
+    for (int i = 0; i < n; i++) ios[i].res = IO_PENDING;
+#ifdef DISK_HAVE_URING
+    while (disk->ring.fd >= 0 && n > 0) {
+        int batch = n < (int)disk->ring.entries ? n : (int)disk->ring.entries;
+        if (ring_run(disk, ios, batch) != 0) {
+            fprintf(stderr, "Disk: io_uring failed (%s), using buffered I/O\n", strerror(errno));
+            ring_free(&disk->ring);
+            disk->backend = DISK_BACKEND_BUFFERED;
+            break;
+        }
+        ios += batch;
+        n -= batch;
     }
+#endif
+    // Whatever the ring did not finish, including the rest of a failed batch
+    for (int i = 0; i < n; i++) {
+        DiskIo* io = &ios[i];
+        if (io->res != IO_PENDING) continue;
+        if (io->op == IO_SYNC) io->res = fdatasync(io->fd);
+        else if (io->op == IO_READ) io->res = preadv(io->fd, io->iov, io->iovcnt, io->off);
+        else io->res = pwritev(io->fd, io->iov, io->iovcnt, io->off);
+        if (io->res < 0) io->res = -errno;
+        disk->metrics.syscalls++;
+    }
+}
 
-    disk->last_error = 0;
-    printf("Disk write: addr=0x%04X, len=%zu\n", addr, len);
+// ---------- overlay images ----------
+// An overlay holds only the blocks written since it was created; every other
+// block is read from a shared, read-only base image. The overlay file starts
+// with a CowHeader block and a map with one bit per block (sized for
+// DISK_MAX_SIZE), followed by the image data at COW_DATA_OFFSET, sparse until
+// written. All image I/O passes through disk_io, which sends writes to the
+// overlay and marks their blocks, and splits reads into runs served by the
+// overlay or the base. Blocks past the end of the base live in the overlay.
+static int cow_has(Disk* disk, uint32_t block) {
+    return (uint64_t)block * BUFFER_SIZE >= disk->base_size || (disk->cow_map[block / 8] >> (block % 8)) & 1;
+}
+
+static void cow_mark(Disk* disk, uint64_t off, uint64_t len) {
+    for (uint32_t b = (uint32_t)(off / BUFFER_SIZE); (uint64_t)b * BUFFER_SIZE < off + len; b++) {
+        disk->cow_map[b / 8] |= (uint8_t)(1u << (b % 8));
+        disk->cow_dirty[b / 8 / BUFFER_SIZE] = 1;
+    }
+}
+
+static int cow_save_map(Disk* disk) {
+    int ret = 0;
+    for (uint32_t i = 0; i < COW_MAP_BYTES / BUFFER_SIZE; i++) {
+        if (!disk->cow_dirty[i]) continue;
+        disk->metrics.syscalls++;
+        if (disk_pwrite_full(disk->fd, disk->cow_map + (size_t)i * BUFFER_SIZE, BUFFER_SIZE,
+                             COW_MAP_OFFSET + (off_t)i * BUFFER_SIZE) != 0) {
+            ret = -1;
+            continue;
+        }
+        disk->cow_dirty[i] = 0;
+    }
+    return ret;
+}
+
+// Synchronous fallbacks for short transfers: whole blocks at `off`.
+static int image_pread(Disk* disk, uint8_t* buf, size_t len, off_t off) {
+    if (disk->base_fd < 0) return disk_pread_full(disk->fd, buf, len, off);
+    for (size_t done = 0; done < len; done += BUFFER_SIZE) {
+        uint32_t block = (uint32_t)((off + (off_t)done) / BUFFER_SIZE);
+        int over = cow_has(disk, block);
+        if (disk_pread_full(over ? disk->fd : disk->base_fd, buf + done, BUFFER_SIZE,
+                            off + (off_t)done + (over ? COW_DATA_OFFSET : 0)) != 0) {
+            return -1;
+        }
+    }
     return 0;
 }
 
-uint16_t disk_status(Disk* disk) {
-    return disk->last_error;
+static int image_pwrite(Disk* disk, const uint8_t* buf, size_t len, off_t off) {
+    if (disk->base_fd < 0) return disk_pwrite_full(disk->fd, buf, len, off);
+    cow_mark(disk, (uint64_t)off, len);
+    return disk_pwrite_full(disk->fd, buf, len, off + COW_DATA_OFFSET);
 }
 
-int disk_create_file(Disk* disk, const char* filename) {
-    if (disk->file_count >= MAX_FILES) {
-        disk->last_error = 2;
-        fprintf(stderr, "Disk error: Max file limit reached\n");
-        return 1;
+static void disk_io(Disk* disk, DiskIo* ios, int n) {
+    if (disk->base_fd < 0) {
+        disk_io_submit(disk, ios, n);
+        return;
+    }
+    int cap = 0, iov_cap = 0;
+    for (int i = 0; i < n; i++) {
+        if (ios[i].fd == disk->fd && ios[i].op == IO_READ) {
+            size_t len = 0;
+            for (int k = 0; k < ios[i].iovcnt; k++) len += ios[i].iov[k].iov_len;
+            cap += (int)(len / BUFFER_SIZE) + 1;
+            iov_cap += (int)(len / BUFFER_SIZE) + ios[i].iovcnt;
+        } else {
+            cap++;
+        }
+    }
+    DiskIo* sub = (DiskIo*)malloc((size_t)cap * sizeof(DiskIo));
+    ssize_t* want = (ssize_t*)malloc((size_t)cap * sizeof(ssize_t));   // -1: result passes through
+    int* owner = (int*)malloc((size_t)cap * sizeof(int));
+    struct iovec* iov = (struct iovec*)malloc((size_t)(iov_cap + 1) * sizeof(struct iovec));
+    if (!sub || !want || !owner || !iov) {
+        for (int i = 0; i < n; i++) ios[i].res = -ENOMEM;
+        free(sub); free(want); free(owner); free(iov);
+        return;
     }
 
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (disk->files[i].name[0] == '\0') {
-            strncpy(disk->files[i].name, filename, MAX_FILENAME - 1);
-            disk->files[i].name[MAX_FILENAME - 1] = '\0';
-            disk->files[i].start_addr = DIR_OFFSET + MAX_FILES * FILE_ENTRY_SIZE + disk->file_count * 1024;
-            disk->files[i].size = 0;
-            disk->file_count++;
-            disk->last_error = 0;
-            return 0;
+    int m = 0, v = 0;
+    for (int i = 0; i < n; i++) {
+        DiskIo* io = &ios[i];
+        if (io->fd != disk->fd || io->op != IO_READ) {
+            if (io->fd == disk->fd && io->op == IO_WRITE) {
+                size_t len = 0;
+                for (int k = 0; k < io->iovcnt; k++) len += io->iov[k].iov_len;
+                cow_mark(disk, (uint64_t)io->off, len);
+            }
+            sub[m] = *io;
+            if (io->fd == disk->fd && io->op == IO_WRITE) sub[m].off += COW_DATA_OFFSET;
+            want[m] = -1;
+            owner[m++] = i;
+            continue;
+        }
+        io->res = 0;
+        int k = 0;
+        size_t koff = 0;
+        size_t total = 0;
+        for (int j = 0; j < io->iovcnt; j++) total += io->iov[j].iov_len;
+        for (uint64_t off = (uint64_t)io->off, end = off + total; off < end; ) {
+            int over = cow_has(disk, (uint32_t)(off / BUFFER_SIZE));
+            uint64_t run_end = off + BUFFER_SIZE;
+            while (run_end < end && cow_has(disk, (uint32_t)(run_end / BUFFER_SIZE)) == over) run_end += BUFFER_SIZE;
+            if (run_end > end) run_end = end;
+            DiskIo* s = &sub[m];
+            *s = (DiskIo){ IO_READ, over ? disk->fd : disk->base_fd, &iov[v], 0,
+                           (off_t)(over ? off + COW_DATA_OFFSET : off), 0 };
+            want[m] = (ssize_t)(run_end - off);
+            owner[m++] = i;
+            for (size_t need = run_end - off; need > 0; ) {
+                size_t take = io->iov[k].iov_len - koff < need ? io->iov[k].iov_len - koff : need;
+                iov[v].iov_base = (uint8_t*)io->iov[k].iov_base + koff;
+                iov[v++].iov_len = take;
+                s->iovcnt++;
+                need -= take;
+                koff += take;
+                if (koff == io->iov[k].iov_len) { k++; koff = 0; }
+            }
+            off = run_end;
         }
     }
+    disk_io_submit(disk, sub, m);
 
-    disk->last_error = 2;
-    fprintf(stderr, "Disk error: No free file slots\n");
-    return 1;
+    for (int j = 0; j < m; j++) {
+        DiskIo* io = &ios[owner[j]];
+        if (want[j] < 0) io->res = sub[j].res;
+        else if (io->res < 0) continue;
+        else if (sub[j].res < 0) io->res = sub[j].res;
+        else if (sub[j].res != want[j]) io->res = -EIO;
+        else io->res += sub[j].res;
+    }
+    free(sub);
+    free(want);
+    free(owner);
+    free(iov);
 }
 
-int disk_delete_file(Disk* disk, const char* filename) {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (strcmp(disk->files[i].name, filename) == 0) {
-            disk->files[i].name[0] = '\0';
-            disk->files[i].start_addr = 0;
-            disk->files[i].size = 0;
-            disk->file_count--;
-            disk->last_error = 0;
-            return 0;
+// Creates an empty overlay on `base_path`, sized like the base.
+int disk_create_overlay(const char* path, const char* base_path) {
+    char tmp[512];
+    CowHeader hdr;
+    struct stat st;
+    memset(&hdr, 0, sizeof(hdr));
+    if (!realpath(base_path, hdr.base_path) || stat(hdr.base_path, &st) != 0) return -1;
+    hdr.magic = COW_MAGIC;
+    hdr.version = COW_VERSION;
+    hdr.block_size = BUFFER_SIZE;
+    hdr.base_size = (uint64_t)st.st_size;
+    hdr.base_mtime_sec = st.st_mtim.tv_sec;
+    hdr.base_mtime_nsec = st.st_mtim.tv_nsec;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    uint64_t size = (uint64_t)st.st_size + BUFFER_SIZE - 1;
+    size -= size % BUFFER_SIZE;
+    int ok = disk_pwrite_full(fd, (const uint8_t*)&hdr, sizeof(hdr), 0) == 0 &&
+             ftruncate(fd, (off_t)(COW_DATA_OFFSET + size)) == 0 &&
+             fdatasync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp, path) != 0) {
+        int err = errno;
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Reads the base image path recorded in an overlay. Returns 0 on success.
+int disk_overlay_base(const char* path, char* base_path, size_t cap) {
+    CowHeader hdr;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int ok = disk_pread_full(fd, (uint8_t*)&hdr, sizeof(hdr), 0) == 0 && hdr.magic == COW_MAGIC;
+    close(fd);
+    if (!ok) return -1;
+    hdr.base_path[sizeof(hdr.base_path) - 1] = '\0';
+    snprintf(base_path, cap, "%s", hdr.base_path);
+    return 0;
+}
+
+// Opens the overlay at `path` on `base_path`, creating it if missing.
+static int cow_open(Disk* disk, const char* path, const char* base_path, const char* journal_path) {
+    char base_real[PATH_MAX];
+    if (!realpath(base_path, base_real)) {
+        fprintf(stderr, "Error: Failed to open base image %s: %s\n", base_path, strerror(errno));
+        return -1;
+    }
+    disk->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (disk->fd < 0 && errno == ENOENT) {
+        unlink(journal_path);
+        if (disk_create_overlay(path, base_real) != 0) {
+            fprintf(stderr, "Error: Failed to create overlay %s: %s\n", path, strerror(errno));
+            return -1;
         }
+        disk->fd = open(path, O_RDWR | O_CLOEXEC);
+    }
+    CowHeader hdr;
+    if (disk->fd < 0 || disk_pread_full(disk->fd, (uint8_t*)&hdr, sizeof(hdr), 0) != 0) {
+        fprintf(stderr, "Error: Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    hdr.base_path[sizeof(hdr.base_path) - 1] = '\0';
+    if (hdr.magic != COW_MAGIC || hdr.version != COW_VERSION || hdr.block_size != BUFFER_SIZE) {
+        fprintf(stderr, "Error: %s is not an overlay image\n", path);
+        return -1;
+    }
+    if (strcmp(hdr.base_path, base_real) != 0) {
+        fprintf(stderr, "Error: Overlay %s belongs to base image %s\n", path, hdr.base_path);
+        return -1;
+    }
+    struct stat st;
+    disk->base_fd = open(base_real, O_RDONLY | O_CLOEXEC);
+    if (disk->base_fd < 0 || fstat(disk->base_fd, &st) != 0) {
+        fprintf(stderr, "Error: Failed to open base image %s: %s\n", base_real, strerror(errno));
+        return -1;
+    }
+    if ((uint64_t)st.st_size != hdr.base_size || st.st_mtim.tv_sec != hdr.base_mtime_sec ||
+        st.st_mtim.tv_nsec != hdr.base_mtime_nsec) {
+        fprintf(stderr, "Disk: Warning: base image %s changed after overlay %s was created\n", base_real, path);
+    }
+    disk->base_size = (uint64_t)st.st_size;
+    disk->base_path = strdup(base_real);
+    disk->cow_map = (uint8_t*)malloc(COW_MAP_BYTES);
+    if (!disk->base_path || !disk->cow_map ||
+        disk_pread_full(disk->fd, disk->cow_map, COW_MAP_BYTES, COW_MAP_OFFSET) != 0) {
+        fprintf(stderr, "Error: Failed to read overlay map of %s\n", path);
+        return -1;
     }
+    return 0;
+}
 
-    disk->last_error = 3;
-    fprintf(stderr, "Disk error: File %s not found\n", filename);
-    return 1;
+// Merges the overlay into its base image: each block written through the
+// overlay is copied into the base, which grows to the image size if needed,
+// and the overlay is emptied. Other overlays on the same base then see the
+// merged blocks they have not written themselves, so commit only once they
+// are discarded. Returns 0 on success.
+int disk_commit_overlay(Disk* disk) {
+    pthread_mutex_lock(&disk->lock);
+    if (disk->base_fd < 0) {
+        pthread_mutex_unlock(&disk->lock);
+        fprintf(stderr, "Disk: Not an overlay image\n");
+        return -1;
+    }
+    disk_flush_locked(disk);
+    int ret = -1;
+    uint8_t* buf = (uint8_t*)malloc(BUFFER_SIZE * 64);
+    int base = open(disk->base_path, O_RDWR | O_CLOEXEC);
+    if (!buf || base < 0) {
+        fprintf(stderr, "Error: Failed to open base image %s: %s\n", disk->base_path, strerror(errno));
+        goto out;
+    }
+    uint32_t blocks = (uint32_t)(disk->size / BUFFER_SIZE);
+    for (uint32_t b = 0; b < blocks; ) {
+        if (!((disk->cow_map[b / 8] >> (b % 8)) & 1)) { b++; continue; }
+        uint32_t run = 1;
+        while (b + run < blocks && run < 64 && ((disk->cow_map[(b + run) / 8] >> ((b + run) % 8)) & 1)) run++;
+        off_t off = (off_t)b * BUFFER_SIZE;
+        if (disk_pread_full(disk->fd, buf, (size_t)run * BUFFER_SIZE, off + COW_DATA_OFFSET) != 0 ||
+            disk_pwrite_full(base, buf, (size_t)run * BUFFER_SIZE, off) != 0) {
+            fprintf(stderr, "Error: Failed to merge blocks into %s: %s\n", disk->base_path, strerror(errno));
+            goto out;
+        }
+        b += run;
+    }
+    struct stat st;
+    if (fstat(base, &st) != 0 || ((uint64_t)st.st_size < disk->size && ftruncate(base, (off_t)disk->size) != 0) ||
+        fdatasync(base) != 0 || fstat(base, &st) != 0) {
+        fprintf(stderr, "Error: Failed to sync %s: %s\n", disk->base_path, strerror(errno));
+        goto out;
+    }
+
+    // The map is cleared durably before the data is dropped, so a crash in
+    // between never exposes zeroed blocks.
+    CowHeader hdr;
+    memset(disk->cow_map, 0, COW_MAP_BYTES);
+    memset(disk->cow_dirty, 1, sizeof(disk->cow_dirty));
+    if (cow_save_map(disk) != 0 || disk_pread_full(disk->fd, (uint8_t*)&hdr, sizeof(hdr), 0) != 0) goto out;
+    hdr.base_size = (uint64_t)st.st_size;
+    hdr.base_mtime_sec = st.st_mtim.tv_sec;
+    hdr.base_mtime_nsec = st.st_mtim.tv_nsec;
+    if (disk_pwrite_full(disk->fd, (const uint8_t*)&hdr, sizeof(hdr), 0) != 0 || fdatasync(disk->fd) != 0 ||
+        ftruncate(disk->fd, COW_DATA_OFFSET) != 0 || ftruncate(disk->fd, (off_t)(COW_DATA_OFFSET + disk->size)) != 0) {
+        fprintf(stderr, "Error: Failed to reset overlay: %s\n", strerror(errno));
+        goto out;
+    }
+    close(disk->base_fd);
+    disk->base_fd = base;
+    disk->base_size = (uint64_t)st.st_size;
+    base = -1;
+    ret = 0;
+out:
+    if (base >= 0) close(base);
+    free(buf);
+    pthread_mutex_unlock(&disk->lock);
+    return ret;
+}
+
+// ---------- page cache (DISK_BACKEND_BUFFERED and DISK_BACKEND_URING) ----------
+static uint32_t cache_bucket(Disk* disk, uint32_t addr) {
+    return (addr / BUFFER_SIZE) & (disk->nbuckets - 1);
+}
+
+static int cache_lookup(Disk* disk, uint32_t addr) {
+    for (int i = disk->buckets[cache_bucket(disk, addr)]; i >= 0; i = disk->pages[i].hnext) {
+        if (disk->pages[i].addr == addr) return i;
+    }
+    return -1;
+}
+
+static void cache_unhash(Disk* disk, int idx) {
+    int* link = &disk->buckets[cache_bucket(disk, disk->pages[idx].addr)];
+    while (*link != idx) link = &disk->pages[*link].hnext;
+    *link = disk->pages[idx].hnext;
+    disk->pages[idx].addr = NO_BLOCK;
+}
+
+static void cache_hash(Disk* disk, int idx, uint32_t addr) {
+    uint32_t b = cache_bucket(disk, addr);
+    disk->pages[idx].addr = addr;
+    disk->pages[idx].hnext = disk->buckets[b];
+    disk->buckets[b] = idx;
+}
+
+static void lru_unlink(Disk* disk, int idx) {
+    CachePage* p = &disk->pages[idx];
+    if (p->prev >= 0) disk->pages[p->prev].next = p->next; else disk->lru_head = p->next;
+    if (p->next >= 0) disk->pages[p->next].prev = p->prev; else disk->lru_tail = p->prev;
+}
+
+static void lru_push_front(Disk* disk, int idx) {
+    CachePage* p = &disk->pages[idx];
+    p->prev = -1;
+    p->next = disk->lru_head;
+    if (disk->lru_head >= 0) disk->pages[disk->lru_head].prev = idx; else disk->lru_tail = idx;
+    disk->lru_head = idx;
+}
+
+static void lru_push_back(Disk* disk, int idx) {
+    CachePage* p = &disk->pages[idx];
+    p->next = -1;
+    p->prev = disk->lru_tail;
+    if (disk->lru_tail >= 0) disk->pages[disk->lru_tail].next = idx; else disk->lru_head = idx;
+    disk->lru_tail = idx;
+}
+
+static void lru_touch(Disk* disk, int idx) {
+    if (disk->lru_head == idx) return;
+    lru_unlink(disk, idx);
+    lru_push_front(disk, idx);
+}
+
+static void cache_init(Disk* disk, int npages, int readahead) {
+    if (npages < 2) npages = 2;
+    disk->npages = npages;
+    disk->readahead_max = readahead < npages / 2 ? readahead : npages / 2;
+    disk->nbuckets = 1;
+    while (disk->nbuckets < (uint32_t)npages * 2) disk->nbuckets <<= 1;
+    disk->pages = (CachePage*)calloc((size_t)npages, sizeof(CachePage));
+    disk->buckets = (int*)malloc(disk->nbuckets * sizeof(int));
+    disk->page_mem = (uint8_t*)malloc((size_t)npages * BUFFER_SIZE);
+    if (!disk->pages || !disk->buckets || !disk->page_mem) {
+        fprintf(stderr, "Error: Failed to allocate disk cache!\n");
+        exit(1);
+    }
+    for (uint32_t b = 0; b < disk->nbuckets; b++) disk->buckets[b] = -1;
+    disk->lru_head = disk->lru_tail = -1;
+    for (int i = 0; i < npages; i++) {
+        disk->pages[i].addr = NO_BLOCK;
+        disk->pages[i].hnext = -1;
+        disk->pages[i].data = disk->page_mem + (size_t)i * BUFFER_SIZE;
+        lru_push_front(disk, i);
+    }
+    disk->last_block = NO_BLOCK;
+}
+
+static void cache_free(Disk* disk) {
+    free(disk->pages);
+    free(disk->buckets);
+    free(disk->page_mem);
+}
+
+static int page_addr_cmp(const void* a, const void* b) {
+    uint32_t x = (*(CachePage* const*)a)->addr, y = (*(CachePage* const*)b)->addr;
+    return (x > y) - (x < y);
+}
+
+// Writes every dirty page back in ascending disk order, coalescing adjacent
+// pages into one pwritev per run; the runs go out as a single batch. With
+// `sync` the batch ends in an fdatasync of the image.
+static int cache_writeback(Disk* disk, int sync) {
+    CachePage** dirty = (CachePage**)malloc((size_t)disk->npages * sizeof(CachePage*));
+    struct iovec* iov = (struct iovec*)malloc((size_t)disk->npages * sizeof(struct iovec));
+    DiskIo* ios = (DiskIo*)malloc((size_t)(disk->npages + 1) * sizeof(DiskIo));
+    int n = 0, nio = 0, ret = 0;
+    if (!dirty || !iov || !ios) {
+        free(dirty);
+        free(iov);
+        free(ios);
+        return -1;
+    }
+    for (int i = 0; i < disk->npages; i++) {
+        if (disk->pages[i].dirty) dirty[n++] = &disk->pages[i];
+    }
+    if (n > 1) qsort(dirty, (size_t)n, sizeof(CachePage*), page_addr_cmp);
+
+    for (int i = 0; i < n; ) {
+        int run = 1;
+        while (i + run < n && run < 64 && dirty[i + run]->addr == dirty[i]->addr + (uint32_t)run * BUFFER_SIZE) run++;
+        for (int k = 0; k < run; k++) {
+            iov[i + k].iov_base = dirty[i + k]->data;
+            iov[i + k].iov_len = BUFFER_SIZE;
+        }
+        ios[nio++] = (DiskIo){ IO_WRITE, disk->fd, &iov[i], run, (off_t)dirty[i]->addr, 0 };
+        i += run;
+    }
+    if (sync) ios[nio++] = (DiskIo){ IO_SYNC, disk->fd, NULL, 0, 0, 0 };
+    disk_io(disk, ios, nio);
+
+    int retried = 0;
+    for (int r = 0; r < nio; r++) {
+        if (ios[r].op != IO_WRITE) continue;
+        int first = (int)(ios[r].iov - iov);
+        for (int k = 0; k < ios[r].iovcnt; k++) {
+            CachePage* p = dirty[first + k];
+            if (ios[r].res != (ssize_t)ios[r].iovcnt * BUFFER_SIZE) {
+                retried = 1;
+                if (image_pwrite(disk, p->data, BUFFER_SIZE, p->addr) != 0) {
+                    ret = -1;
+                    continue;
+                }
+            }
+            p->dirty = 0;
+        }
+        disk->metrics.cache.writebacks += (uint64_t)ios[r].iovcnt;
+    }
+    if (sync && (retried || ios[nio - 1].res != 0)) {
+        disk->metrics.syscalls++;
+        if (fdatasync(disk->fd) != 0) ret = -1;
+    }
+    if (n > 0) disk->metrics.cache.writeback_batches++;
+    free(dirty);
+    free(iov);
+    free(ios);
+    return ret;
+}
+
+// Takes the least recently used page for reuse, writing back dirty pages first.
+static int cache_victim(Disk* disk) {
+    int idx = disk->lru_tail;
+    if (disk->pages[idx].dirty) cache_writeback(disk, 0);
+    if (disk->pages[idx].addr != NO_BLOCK) cache_unhash(disk, idx);
+    return idx;
+}
+
+// Returns the cache page holding the block at `addr`, loading it on a miss.
+// `fill` is 0 when the caller overwrites the whole block, so no read is needed.
+// A miss that continues a sequential run also reads ahead a growing window of
+// following blocks in the same preadv.
+static CachePage* cache_get(Disk* disk, uint32_t addr, int fill) {
+    int sequential = (disk->last_block != NO_BLOCK && addr == disk->last_block + BUFFER_SIZE);
+    disk->last_block = addr;
+
+    int idx = cache_lookup(disk, addr);
+    if (idx >= 0) {
+        disk->metrics.cache.hits++;
+        lru_touch(disk, idx);
+        return &disk->pages[idx];
+    }
+    disk->metrics.cache.misses++;
+
+    if (!sequential || !fill) disk->ra_window = 0;
+    else disk->ra_window = disk->ra_window ? disk->ra_window * 2 : 1;
+    if (disk->ra_window > disk->readahead_max) disk->ra_window = disk->readahead_max;
+
+    int slots[1 + DISK_MAX_READAHEAD];
+    int count = 0;
+    slots[count++] = cache_victim(disk);
+    lru_touch(disk, slots[0]);
+    cache_hash(disk, slots[0], addr);
+    for (int k = 1; k <= disk->ra_window; k++) {
+        uint32_t next = addr + (uint32_t)k * BUFFER_SIZE;
+        if (next >= disk->size || cache_lookup(disk, next) >= 0) break;
+        int s = cache_victim(disk);
+        lru_touch(disk, s);
+        cache_hash(disk, s, next);
+        slots[count++] = s;
+    }
+    lru_touch(disk, slots[0]);
+
+    if (fill) {
+        struct iovec iov[1 + DISK_MAX_READAHEAD];
+        for (int k = 0; k < count; k++) {
+            iov[k].iov_base = disk->pages[slots[k]].data;
+            iov[k].iov_len = BUFFER_SIZE;
+        }
+        DiskIo io = { IO_READ, disk->fd, iov, count, (off_t)addr, 0 };
+        disk_io(disk, &io, 1);
+        if (io.res != (ssize_t)count * BUFFER_SIZE) {
+            for (int k = 0; k < count; k++) {
+                CachePage* p = &disk->pages[slots[k]];
+                if (image_pread(disk, p->data, BUFFER_SIZE, p->addr) != 0) {
+                    for (int j = 0; j < count; j++) cache_unhash(disk, slots[j]);
+                    return NULL;
+                }
+            }
+        }
+        disk->metrics.cache.readahead += (uint64_t)(count - 1);
+    }
+    return &disk->pages[slots[0]];
+}
+
+// ---------- image access (either backend, no logging) ----------
+static int disk_load(Disk* disk, uint32_t addr, size_t len, uint8_t* data) {
+    if (disk->map) {
+        memcpy(data, disk->map + addr, len);
+        return 0;
+    }
+    size_t offset = 0;
+    while (offset < len) {
+        uint32_t block_addr = addr + offset - (addr + offset) % BUFFER_SIZE;
+        size_t block_offset = (addr + offset) % BUFFER_SIZE;
+        size_t to_read = len - offset < BUFFER_SIZE - block_offset ? len - offset : BUFFER_SIZE - block_offset;
+
+        CachePage* page = cache_get(disk, block_addr, 1);
+        if (!page) {
+            fprintf(stderr, "Disk read error: Failed to read block at 0x%04X\n", block_addr);
+            return 1;
+        }
+        memcpy(data + offset, page->data + block_offset, to_read);
+        offset += to_read;
+    }
+    return 0;
+}
+
+static int disk_store(Disk* disk, uint32_t addr, size_t len, const uint8_t* data) {
+    if (disk->map) {
+        memcpy(disk->map + addr, data, len);
+        return 0;
+    }
+    size_t offset = 0;
+    while (offset < len) {
+        uint32_t block_addr = addr + offset - (addr + offset) % BUFFER_SIZE;
+        size_t block_offset = (addr + offset) % BUFFER_SIZE;
+        size_t to_write = len - offset < BUFFER_SIZE - block_offset ? len - offset : BUFFER_SIZE - block_offset;
+
+        CachePage* page = cache_get(disk, block_addr, to_write != BUFFER_SIZE);
+        if (!page) {
+            fprintf(stderr, "Disk read error: Failed to read block at 0x%04X\n", block_addr);
+            return 1;
+        }
+        memcpy(page->data + block_offset, data + offset, to_write);
+        page->dirty = 1;
+        offset += to_write;
+    }
+    return 0;
+}
+
+// Block-aligned bulk transfers on the cached backends skip the page cache: the
+// whole blocks in the middle of the range move between the image and the
+// caller's buffer (guest memory for INT 10) with one preadv/pwritev, and only
+// a partial head or tail block goes through the cache. Cached copies stay
+// authoritative for reads and are dropped by writes. With mmap the memcpy in
+// disk_load/disk_store already is the only copy.
+static int direct_span(Disk* disk, uint32_t addr, size_t len, size_t* head, size_t* mid) {
+    if (disk->map) return 0;
+    *head = (BUFFER_SIZE - addr % BUFFER_SIZE) % BUFFER_SIZE;
+    if (*head >= len) return 0;
+    *mid = (len - *head) / BUFFER_SIZE * BUFFER_SIZE;
+    return *mid > 0;
+}
+
+static int disk_load_direct(Disk* disk, uint32_t addr, size_t len, uint8_t* data) {
+    size_t head, mid;
+    if (!direct_span(disk, addr, len, &head, &mid)) return disk_load(disk, addr, len, data);
+    if (head && disk_load(disk, addr, head, data) != 0) return 1;
+
+    uint32_t start = addr + (uint32_t)head;
+    struct iovec iov = { data + head, mid };
+    DiskIo io = { IO_READ, disk->fd, &iov, 1, (off_t)start, 0 };
+    disk_io(disk, &io, 1);
+    if (io.res != (ssize_t)mid && image_pread(disk, data + head, mid, start) != 0) {
+        fprintf(stderr, "Disk read error: Failed to read 0x%04X + %zu\n", start, mid);
+        return 1;
+    }
+    for (int i = 0; i < disk->npages; i++) {
+        CachePage* p = &disk->pages[i];
+        if (p->addr != NO_BLOCK && p->addr >= start && p->addr - start < mid) {
+            memcpy(data + head + (p->addr - start), p->data, BUFFER_SIZE);
+        }
+    }
+    disk->metrics.cache.bypassed += mid / BUFFER_SIZE;
+
+    size_t tail = len - head - mid;
+    return tail ? disk_load(disk, start + (uint32_t)mid, tail, data + head + mid) : 0;
+}
+
+static int disk_store_direct(Disk* disk, uint32_t addr, size_t len, const uint8_t* data) {
+    size_t head, mid;
+    if (!direct_span(disk, addr, len, &head, &mid)) return disk_store(disk, addr, len, data);
+    if (head && disk_store(disk, addr, head, data) != 0) return 1;
+
+    uint32_t start = addr + (uint32_t)head;
+    for (int i = 0; i < disk->npages; i++) {
+        CachePage* p = &disk->pages[i];
+        if (p->addr != NO_BLOCK && p->addr >= start && p->addr - start < mid) {
+            p->dirty = 0;
+            cache_unhash(disk, i);
+            lru_unlink(disk, i);
+            lru_push_back(disk, i);
+        }
+    }
+    struct iovec iov = { (void*)(data + head), mid };
+    DiskIo io = { IO_WRITE, disk->fd, &iov, 1, (off_t)start, 0 };
+    disk_io(disk, &io, 1);
+    if (io.res != (ssize_t)mid && image_pwrite(disk, data + head, mid, start) != 0) {
+        fprintf(stderr, "Disk write error: Failed to write 0x%04X + %zu\n", start, mid);
+        return 1;
+    }
+    disk->metrics.cache.bypassed += mid / BUFFER_SIZE;
+
+    size_t tail = len - head - mid;
+    return tail ? disk_store(disk, start + (uint32_t)mid, tail, data + head + mid) : 0;
+}
+
+// ---------- write-ahead journal ----------
+// Writes are applied to the image (map or cache) immediately and also
+// collected into an open transaction. A transaction is committed once its
+// window (commit_ms) expires or it reaches JOURNAL_GROUP_BYTES: the metadata
+// changed since the last commit is appended, the whole batch is written to
+// <image>.journal, and one fdatasync makes it durable. Only then is the
+// metadata stored into the image, so the image never holds metadata from an
+// uncommitted transaction. A checkpoint syncs the image and empties the
+// journal. disk_open replays committed transactions left by a crash.
+static uint32_t crc32_update(uint32_t crc, const uint8_t* p, size_t len) {
+    static uint32_t table[256];
+    if (!table[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    while (len--) crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void journal_open_txn(Disk* disk) {
+    if (disk->txn_open) return;
+    disk->txn_open = 1;
+    clock_gettime(CLOCK_REALTIME, &disk->txn_deadline);
+    disk->txn_deadline.tv_sec += disk->commit_ms / 1000;
+    disk->txn_deadline.tv_nsec += (long)(disk->commit_ms % 1000) * 1000000L;
+    if (disk->txn_deadline.tv_nsec >= 1000000000L) {
+        disk->txn_deadline.tv_sec++;
+        disk->txn_deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_signal(&disk->wake);
+}
+
+// Appends one {addr, len, data} record to the open transaction.
+static void txn_add(Disk* disk, uint32_t addr, size_t len, const uint8_t* data) {
+    size_t need = disk->txn_len + sizeof(JournalRecord) + len;
+    if (need > disk->txn_cap) {
+        size_t cap = disk->txn_cap ? disk->txn_cap : JOURNAL_GROUP_BYTES;
+        while (cap < need) cap *= 2;
+        uint8_t* txn = (uint8_t*)realloc(disk->txn, cap);
+        if (!txn) {
+            fprintf(stderr, "Error: Failed to allocate journal transaction!\n");
+            exit(1);
+        }
+        disk->txn = txn;
+        disk->txn_cap = cap;
+    }
+    JournalRecord rec = { addr, (uint32_t)len };
+    memcpy(disk->txn + disk->txn_len, &rec, sizeof(rec));
+    memcpy(disk->txn + disk->txn_len + sizeof(rec), data, len);
+    disk->txn_len = need;
+}
+
+// Stores a range through the journal; `direct` allows bypassing the page cache.
+static int disk_store_logged(Disk* disk, uint32_t addr, size_t len, const uint8_t* data, int direct) {
+    if (disk->journal_fd >= 0) {
+        if (disk->txn_len > 0 && disk->txn_len + sizeof(JournalRecord) + len > JOURNAL_GROUP_BYTES) {
+            journal_commit(disk);
+        }
+        txn_add(disk, addr, len, data);
+    }
+    journal_open_txn(disk);
+    return direct ? disk_store_direct(disk, addr, len, data) : disk_store(disk, addr, len, data);
+}
+
+// Applies the records in txn[0, len) to the image.
+static int journal_apply(Disk* disk, const uint8_t* txn, size_t len) {
+    size_t off = 0;
+    while (off + sizeof(JournalRecord) <= len) {
+        JournalRecord rec;
+        memcpy(&rec, txn + off, sizeof(rec));
+        off += sizeof(rec);
+        if (rec.len > len - off || (uint64_t)rec.addr + rec.len > disk->size) return 1;
+        if (disk_store(disk, rec.addr, rec.len, txn + off) != 0) return 1;
+        off += rec.len;
+    }
+    return off == len ? 0 : 1;
+}
+
+static void disk_sync_image(Disk* disk) {
+    if (disk->map) {
+        msync(disk->map, (size_t)disk->size, MS_SYNC);
+        disk->metrics.syscalls++;
+    } else if (disk->base_fd >= 0) {
+        // The map must reach the overlay with the blocks it points at.
+        cache_writeback(disk, 0);
+        cow_save_map(disk);
+        disk->metrics.syscalls++;
+        if (fdatasync(disk->fd) != 0) fprintf(stderr, "Disk: fdatasync failed: %s\n", strerror(errno));
+    } else {
+        cache_writeback(disk, 1);
+    }
+}
+
+static void journal_checkpoint(Disk* disk) {
+    disk_sync_image(disk);
+    if (disk->journal_fd < 0 || disk->journal_off == 0) return;
+    disk->metrics.syscalls += 2;
+    if (ftruncate(disk->journal_fd, 0) != 0 || fdatasync(disk->journal_fd) != 0) {
+        fprintf(stderr, "Disk: Failed to reset journal: %s\n", strerror(errno));
+    }
+    disk->journal_off = 0;
+}
+
+// A transaction whose journal write or sync fails is not applied: the
+// metadata records are dropped again, the blocks they covered are marked
+// dirty, and the transaction stays open so the next commit retries it.
+static void journal_commit(Disk* disk) {
+    if (!disk->txn_open) return;
+    size_t meta_start = disk->txn_len;
+    uint32_t bitmap_blocks = disk->sb.bitmap_blocks, dir_blocks = disk->sb.dir.size / BUFFER_SIZE;
+    uint8_t* dirty = (uint8_t*)malloc((size_t)bitmap_blocks + dir_blocks + 1);
+    if (!dirty) {
+        fprintf(stderr, "Error: Failed to allocate journal transaction!\n");
+        exit(1);
+    }
+    memcpy(dirty, disk->bitmap_dirty, bitmap_blocks);
+    memcpy(dirty + bitmap_blocks, disk->dir_dirty, dir_blocks);
+    fs_log_meta(disk);
+
+    if (disk->journal_fd >= 0) {
+        JournalHeader hdr = { JOURNAL_MAGIC, disk->journal_seq, (uint32_t)disk->txn_len,
+                              crc32_update(0, disk->txn, disk->txn_len) };
+        struct iovec iov[2] = { { &hdr, sizeof(hdr) }, { disk->txn, disk->txn_len } };
+        DiskIo ios[2] = {
+            { IO_WRITE, disk->journal_fd, iov, 2, (off_t)disk->journal_off, 0 },
+            { IO_SYNC, disk->journal_fd, NULL, 0, 0, 0 },
+        };
+        uint64_t start = now_ns();
+        disk_io(disk, ios, 2);
+        ssize_t w = ios[0].res;
+        if (w != (ssize_t)(sizeof(hdr) + disk->txn_len) || ios[1].res != 0) {
+            int err = w < 0 ? (int)-w : ios[1].res < 0 ? (int)-ios[1].res : EIO;
+            fprintf(stderr, "Disk: Journal commit failed: %s\n", strerror(err));
+            for (uint32_t b = 0; b < bitmap_blocks; b++) disk->bitmap_dirty[b] |= dirty[b];
+            for (uint32_t b = 0; b < dir_blocks; b++) disk->dir_dirty[b] |= dirty[bitmap_blocks + b];
+            free(dirty);
+            disk->txn_len = meta_start;
+            disk->txn_open = 0;
+            journal_open_txn(disk);
+            return;
+        } else {
+            disk->journal_off += (uint64_t)w;
+            disk->journal_seq++;
+            disk->metrics.journal_commits++;
+            disk->metrics.journal_bytes += (uint64_t)w;
+            metrics_op(disk, DISK_OP_COMMIT, start, 0);
+        }
+    }
+    free(dirty);
+    journal_apply(disk, disk->txn + meta_start, disk->txn_len - meta_start);
+    disk->txn_len = 0;
+    disk->txn_open = 0;
+    if (disk->journal_off >= JOURNAL_CHECKPOINT_BYTES) journal_checkpoint(disk);
+}
+
+// Replays every intact transaction in the journal, in sequence order, then
+// checkpoints. A torn or stale tail stops the replay.
+static void journal_replay(Disk* disk) {
+    struct stat st;
+    if (fstat(disk->journal_fd, &st) != 0 || st.st_size == 0) return;
+    uint8_t* buf = (uint8_t*)malloc((size_t)st.st_size);
+    if (!buf || disk_pread_full(disk->journal_fd, buf, (size_t)st.st_size, 0) != 0) {
+        fprintf(stderr, "Disk: Failed to read journal\n");
+        free(buf);
+        return;
+    }
+    size_t off = 0;
+    int replayed = 0;
+    while (off + sizeof(JournalHeader) <= (size_t)st.st_size) {
+        JournalHeader hdr;
+        memcpy(&hdr, buf + off, sizeof(hdr));
+        const uint8_t* txn = buf + off + sizeof(hdr);
+        if (hdr.magic != JOURNAL_MAGIC || hdr.len > st.st_size - off - sizeof(hdr) ||
+            (replayed > 0 && hdr.seq != disk->journal_seq) || crc32_update(0, txn, hdr.len) != hdr.crc) {
+            break;
+        }
+        if (journal_apply(disk, txn, hdr.len) != 0) break;
+        disk->journal_seq = hdr.seq + 1;
+        replayed++;
+        off += sizeof(hdr) + hdr.len;
+    }
+    free(buf);
+    disk->journal_off = (uint64_t)st.st_size;
+    journal_checkpoint(disk);
+    if (replayed > 0) printf("Disk: Replayed %d journal transactions\n", replayed);
+}
+
+static int disk_read_locked(Disk* disk, uint32_t addr, size_t len, uint8_t* data) {
+    uint64_t start = now_ns();
+    if ((uint64_t)addr + len > disk->size) {
+        disk->last_error = 1;
+        fprintf(stderr, "Disk read error: Address 0x%04X + %zu exceeds disk size\n", addr, len);
+        return 1;
+    }
+    if (disk_load_direct(disk, addr, len, data) != 0) {
+        disk->last_error = 1;
+        return 1;
+    }
+    disk->last_error = 0;
+    metrics_op(disk, DISK_OP_READ, start, len);
+    if (disk->trace) printf("Disk read: addr=0x%04X, len=%zu\n", addr, len);
+    return 0;
+}
+
+static int disk_write_locked(Disk* disk, uint32_t addr, size_t len, const uint8_t* data) {
+    uint64_t start = now_ns();
+    if ((uint64_t)addr + len > disk->size) {
+        disk->last_error = 1;
+        fprintf(stderr, "Disk write error: Address 0x%04X + %zu exceeds disk size\n", addr, len);
+        return 1;
+    }
+    if (disk_store_logged(disk, addr, len, data, 1) != 0) {
+        disk->last_error = 1;
+        return 1;
+    }
+    disk->last_error = 0;
+    metrics_op(disk, DISK_OP_WRITE, start, len);
+    if (disk->trace) printf("Disk write: addr=0x%04X, len=%zu\n", addr, len);
+    return 0;
+}
+
+// ---------- file system ----------
+static int bit_test(const uint64_t* bitmap, uint32_t block) {
+    return (int)((bitmap[block >> 6] >> (block & 63)) & 1);
+}
+
+static void fs_mark(Disk* disk, uint32_t start, uint32_t count, int used) {
+    for (uint32_t b = start; b < start + count; b++) {
+        if (used) disk->bitmap[b >> 6] |= 1ULL << (b & 63);
+        else disk->bitmap[b >> 6] &= ~(1ULL << (b & 63));
+    }
+    if (used) disk->sb.free_blocks -= count;
+    else disk->sb.free_blocks += count;
+    if (count > 0) {
+        for (uint32_t b = start / (BUFFER_SIZE * 8); b <= (start + count - 1) / (BUFFER_SIZE * 8); b++) {
+            disk->bitmap_dirty[b] = 1;
+        }
+        journal_open_txn(disk);
+    }
+}
+
+// Marks a directory entry as changed so the next commit logs it. The
+// directory's own entry lives in the superblock, which every commit logs.
+static void fs_touch(Disk* disk, const FileEntry* e) {
+    if (e != &disk->sb.dir) disk->dir_dirty[(size_t)(e - disk->files) * FILE_ENTRY_SIZE / BUFFER_SIZE] = 1;
+    journal_open_txn(disk);
+}
+
+// Length of the free run starting at `start`, up to `limit` blocks.
+static uint32_t fs_free_run(Disk* disk, uint32_t start, uint32_t limit) {
+    uint32_t n = 0;
+    while (n < limit && start + n < disk->sb.total_blocks && !bit_test(disk->bitmap, start + n)) n++;
+    return n;
+}
+
+// First free run of at least `min` blocks starting in [lo, hi). Fully
+// allocated bitmap words are skipped 64 blocks at a time.
+static uint32_t fs_scan(Disk* disk, uint32_t lo, uint32_t hi, uint32_t min, uint32_t want, uint32_t* got) {
+    uint32_t b = lo;
+    while (b < hi) {
+        if ((b & 63) == 0 && disk->bitmap[b >> 6] == ~0ULL) {
+            b += 64;
+            continue;
+        }
+        if (bit_test(disk->bitmap, b)) {
+            b++;
+            continue;
+        }
+        uint32_t run = fs_free_run(disk, b, want);
+        if (run >= min) {
+            *got = run;
+            return b;
+        }
+        b += run + 1;
+    }
+    return NO_BLOCK;
+}
+
+// Next-fit allocation search: continues from where the previous allocation
+// ended, so a series of allocations walks the bitmap once instead of
+// rescanning the full prefix each time.
+static uint32_t fs_find_run(Disk* disk, uint32_t min, uint32_t want, uint32_t* got) {
+    uint32_t start = fs_scan(disk, disk->alloc_cursor, disk->sb.total_blocks, min, want, got);
+    if (start == NO_BLOCK) start = fs_scan(disk, disk->sb.data_start, disk->alloc_cursor, min, want, got);
+    if (start != NO_BLOCK) disk->alloc_cursor = start + *got;
+    return start;
+}
+
+static uint32_t fs_file_blocks(const FileEntry* e) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < e->extent_count; i++) n += e->extents[i].count;
+    return n;
+}
+
+static void fs_add_extent(Disk* disk, FileEntry* e, uint32_t start, uint32_t count) {
+    fs_mark(disk, start, count, 1);
+    e->extents[e->extent_count].start = start;
+    e->extents[e->extent_count].count = count;
+    e->extent_count++;
+    fs_touch(disk, e);
+}
+
+static void fs_free_file(Disk* disk, FileEntry* e) {
+    for (uint32_t i = 0; i < e->extent_count; i++) {
+        fs_mark(disk, e->extents[i].start, e->extents[i].count, 0);
+    }
+    e->extent_count = 0;
+    fs_touch(disk, e);
+}
+
+// Copies between `data` and the file's blocks starting at byte `offset`, one
+// extent-contiguous span at a time. XFER_LOG only adds the spans to the open
+// journal transaction.
+static int fs_transfer(Disk* disk, const FileEntry* e, uint32_t offset, size_t len, uint8_t* data, int mode) {
+    while (len > 0) {
+        uint32_t lblock = offset / BUFFER_SIZE;
+        uint32_t i = 0;
+        while (i < e->extent_count && lblock >= e->extents[i].count) lblock -= e->extents[i++].count;
+        if (i == e->extent_count) return 1;
+        size_t span = (size_t)(e->extents[i].count - lblock) * BUFFER_SIZE - offset % BUFFER_SIZE;
+        size_t n = len < span ? len : span;
+        uint32_t addr = (e->extents[i].start + lblock) * BUFFER_SIZE + offset % BUFFER_SIZE;
+        if (mode == XFER_LOG) txn_add(disk, addr, n, data);
+        else if (mode == XFER_WRITE ? disk_store_logged(disk, addr, n, data, 1) : disk_load_direct(disk, addr, n, data)) return 1;
+        offset += (uint32_t)n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Moves a file into a single run of `need` blocks.
+static int fs_relocate(Disk* disk, FileEntry* e, uint32_t need) {
+    uint32_t got;
+    uint32_t start = fs_find_run(disk, need, need, &got);
+    if (start == NO_BLOCK) return 1;
+    uint8_t buf[BUFFER_SIZE];
+    uint32_t used = (e->size + BUFFER_SIZE - 1) / BUFFER_SIZE;
+    for (uint32_t b = 0; b < used; b++) {
+        if (fs_transfer(disk, e, b * BUFFER_SIZE, BUFFER_SIZE, buf, XFER_READ) != 0 ||
+            disk_store_logged(disk, (start + b) * BUFFER_SIZE, BUFFER_SIZE, buf, 0) != 0) {
+            return 1;
+        }
+    }
+    fs_free_file(disk, e);
+    fs_add_extent(disk, e, start, need);
+    return 0;
+}
+
+// Grows a file's allocation to at least `need` blocks. The tail extent is
+// extended in place when the blocks after it are free; otherwise a new run is
+// added. Requests round up to double the current allocation, so a file
+// written sequentially is reallocated O(log n) times and stays in few extents.
+// Returns 0, or 1 if there is no room.
+static int fs_grow(Disk* disk, FileEntry* e, uint32_t need) {
+    uint32_t have = fs_file_blocks(e);
+    if (need <= have) return 0;
+    uint32_t extra = need - have;
+    uint32_t want = have > extra ? have : extra;
+    if (extra > disk->sb.free_blocks) return 1;
+
+    if (e->extent_count > 0) {
+        Extent* last = &e->extents[e->extent_count - 1];
+        uint32_t run = fs_free_run(disk, last->start + last->count, want);
+        if (run >= extra) {
+            fs_mark(disk, last->start + last->count, run, 1);
+            last->count += run;
+            fs_touch(disk, e);
+            return 0;
+        }
+    }
+    uint32_t got;
+    if (e->extent_count < FS_EXTENTS) {
+        uint32_t start = fs_find_run(disk, extra, want, &got);
+        if (start != NO_BLOCK) {
+            fs_add_extent(disk, e, start, got);
+            return 0;
+        }
+    }
+    if (fs_relocate(disk, e, need) == 0) return 0;
+
+    // No contiguous room anywhere: fill the remaining extent slots with
+    // whatever free runs exist, undoing it all if that is still not enough.
+    uint32_t saved = e->extent_count;
+    while (extra > 0 && e->extent_count < FS_EXTENTS) {
+        uint32_t start = fs_find_run(disk, 1, extra, &got);
+        if (start == NO_BLOCK) break;
+        fs_add_extent(disk, e, start, got);
+        extra -= got;
+    }
+    if (extra == 0) return 0;
+    while (e->extent_count > saved) {
+        e->extent_count--;
+        fs_mark(disk, e->extents[e->extent_count].start, e->extents[e->extent_count].count, 0);
+    }
+    return 1;
+}
+
+// ---------- directory ----------
+// The directory is itself stored like a file (sb.dir) holding an array of
+// FileEntry records, and doubles through fs_grow when every slot is in use.
+// In memory, names are indexed by a chained hash table and unused slots are
+// kept on a stack, so lookup, create and delete do not scan the directory.
+static uint32_t fs_name_hash(const char* name) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < MAX_FILENAME - 1 && name[i]; i++) {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void fs_index_insert(Disk* disk, int idx) {
+    uint32_t b = fs_name_hash(disk->files[idx].name) & (disk->name_nbuckets - 1);
+    disk->name_next[idx] = disk->name_buckets[b];
+    disk->name_buckets[b] = idx;
+}
+
+static void fs_index_remove(Disk* disk, int idx) {
+    int* link = &disk->name_buckets[fs_name_hash(disk->files[idx].name) & (disk->name_nbuckets - 1)];
+    while (*link != idx) link = &disk->name_next[*link];
+    *link = disk->name_next[idx];
+}
+
+// Rebuilds the name index and free slot stack for the current directory size.
+static void fs_index_build(Disk* disk) {
+    uint32_t cap = disk->dir_capacity;
+    disk->name_nbuckets = 1;
+    while (disk->name_nbuckets < cap) disk->name_nbuckets <<= 1;
+    free(disk->name_buckets);
+    free(disk->name_next);
+    free(disk->free_slots);
+    disk->name_buckets = (int*)malloc(disk->name_nbuckets * sizeof(int));
+    disk->name_next = (int*)malloc(cap * sizeof(int));
+    disk->free_slots = (int*)malloc(cap * sizeof(int));
+    if (!disk->name_buckets || !disk->name_next || !disk->free_slots) {
+        fprintf(stderr, "Error: Failed to allocate directory index!\n");
+        exit(1);
+    }
+    for (uint32_t b = 0; b < disk->name_nbuckets; b++) disk->name_buckets[b] = -1;
+    disk->file_count = 0;
+    disk->free_count = 0;
+    for (int i = (int)cap - 1; i >= 0; i--) {
+        if (disk->files[i].name[0] != '\0') {
+            fs_index_insert(disk, i);
+            disk->file_count++;
+        } else {
+            disk->free_slots[disk->free_count++] = i;
+        }
+    }
+}
+
+static FileEntry* fs_lookup(Disk* disk, const char* filename) {
+    uint32_t b = fs_name_hash(filename) & (disk->name_nbuckets - 1);
+    for (int i = disk->name_buckets[b]; i >= 0; i = disk->name_next[i]) {
+        if (strncmp(disk->files[i].name, filename, MAX_FILENAME - 1) == 0) return &disk->files[i];
+    }
+    return NULL;
+}
+
+// Doubles the directory. Returns 0, or 1 if the disk has no room for it.
+static int fs_grow_dir(Disk* disk) {
+    uint32_t cap = disk->dir_capacity * 2;
+    uint32_t need = (cap * FILE_ENTRY_SIZE + BUFFER_SIZE - 1) / BUFFER_SIZE;
+    if (fs_grow(disk, &disk->sb.dir, need) != 0) return 1;
+    FileEntry* files = (FileEntry*)realloc(disk->files, (size_t)cap * sizeof(FileEntry));
+    uint8_t* dirty = (uint8_t*)realloc(disk->dir_dirty, need);
+    if (files) disk->files = files;
+    if (dirty) disk->dir_dirty = dirty;
+    if (!files || !dirty) return 1;
+    memset(files + disk->dir_capacity, 0, (size_t)(cap - disk->dir_capacity) * sizeof(FileEntry));
+    memset(dirty, 1, need); // The directory may have moved: log all of it
+    disk->dir_capacity = cap;
+    disk->sb.dir.size = cap * FILE_ENTRY_SIZE;
+    fs_index_build(disk);
+    return 0;
+}
+
+static void fs_alloc_dir(Disk* disk) {
+    disk->dir_capacity = disk->sb.dir.size / FILE_ENTRY_SIZE;
+    disk->files = (FileEntry*)calloc(disk->dir_capacity, sizeof(FileEntry));
+    disk->dir_dirty = (uint8_t*)calloc(disk->sb.dir.size / BUFFER_SIZE, 1);
+    if (!disk->files || !disk->dir_dirty) {
+        fprintf(stderr, "Error: Failed to allocate disk directory!\n");
+        exit(1);
+    }
+}
+
+static void fs_alloc_bitmap(Disk* disk) {
+    disk->bitmap = (uint64_t*)calloc(disk->sb.bitmap_blocks, BUFFER_SIZE);
+    disk->bitmap_dirty = (uint8_t*)calloc(disk->sb.bitmap_blocks, 1);
+    if (!disk->bitmap || !disk->bitmap_dirty) {
+        fprintf(stderr, "Error: Failed to allocate disk bitmap!\n");
+        exit(1);
+    }
+}
+
+static void fs_format(Disk* disk) {
+    Superblock* sb = &disk->sb;
+    memset(sb, 0, sizeof(*sb));
+    sb->magic = FS_MAGIC;
+    sb->version = FS_VERSION;
+    sb->block_size = BUFFER_SIZE;
+    sb->total_blocks = (uint32_t)(disk->size / BUFFER_SIZE);
+    sb->bitmap_start = FS_RAW_SIZE / BUFFER_SIZE + 1;
+    sb->bitmap_blocks = (sb->total_blocks + BUFFER_SIZE * 8 - 1) / (BUFFER_SIZE * 8);
+    sb->dir_start = sb->bitmap_start + sb->bitmap_blocks;
+    sb->dir_blocks = (DIR_INITIAL_ENTRIES * FILE_ENTRY_SIZE + BUFFER_SIZE - 1) / BUFFER_SIZE;
+    sb->data_start = sb->dir_start + sb->dir_blocks;
+    sb->free_blocks = sb->total_blocks;
+    strcpy(sb->dir.name, "$dir");
+    sb->dir.size = sb->dir_blocks * BUFFER_SIZE;
+    sb->dir.extent_count = 1;
+    sb->dir.extents[0].start = sb->dir_start;
+    sb->dir.extents[0].count = sb->dir_blocks;
+
+    fs_alloc_bitmap(disk);
+    // Metadata blocks and the padding bits past the last block read as allocated.
+    fs_mark(disk, 0, sb->data_start, 1);
+    uint32_t bits = sb->bitmap_blocks * BUFFER_SIZE * 8;
+    for (uint32_t b = sb->total_blocks; b < bits; b++) disk->bitmap[b >> 6] |= 1ULL << (b & 63);
+    fs_alloc_dir(disk);
+}
+
+// Adds the superblock and the bitmap and directory blocks changed since the
+// last commit to the open transaction.
+static void fs_log_meta(Disk* disk) {
+    const Superblock* sb = &disk->sb;
+    txn_add(disk, FS_RAW_SIZE, sizeof(*sb), (const uint8_t*)sb);
+    for (uint32_t b = 0; b < sb->bitmap_blocks; b++) {
+        if (!disk->bitmap_dirty[b]) continue;
+        txn_add(disk, (sb->bitmap_start + b) * BUFFER_SIZE, BUFFER_SIZE, (const uint8_t*)disk->bitmap + (size_t)b * BUFFER_SIZE);
+        disk->bitmap_dirty[b] = 0;
+    }
+    uint32_t dir_blocks = sb->dir.size / BUFFER_SIZE;
+    for (uint32_t b = 0; b < dir_blocks; b++) {
+        if (!disk->dir_dirty[b]) continue;
+        fs_transfer(disk, &sb->dir, b * BUFFER_SIZE, BUFFER_SIZE, (uint8_t*)disk->files + (size_t)b * BUFFER_SIZE, XFER_LOG);
+        disk->dir_dirty[b] = 0;
+    }
+}
+
+// Loads the superblock, bitmap and directory. An image without a file system
+// is formatted; names from the old fixed directory at OLD_DIR_OFFSET (which
+// never tracked file sizes) are carried over as empty files. Version 1 images,
+// whose directory was a fixed region, are upgraded in place.
+static void fs_mount(Disk* disk) {
+    Superblock* sb = &disk->sb;
+    disk_load(disk, FS_RAW_SIZE, sizeof(*sb), (uint8_t*)sb);
+    if (sb->magic == FS_MAGIC && sb->version == 1) {
+        memset(&sb->dir, 0, sizeof(sb->dir));
+        strcpy(sb->dir.name, "$dir");
+        sb->dir.size = sb->dir_blocks * BUFFER_SIZE;
+        sb->dir.extent_count = 1;
+        sb->dir.extents[0].start = sb->dir_start;
+        sb->dir.extents[0].count = sb->dir_blocks;
+        sb->version = FS_VERSION;
+        journal_open_txn(disk);
+    }
+    if (sb->magic == FS_MAGIC && sb->version == FS_VERSION && sb->block_size == BUFFER_SIZE &&
+        sb->total_blocks <= disk->size / BUFFER_SIZE) {
+        fs_alloc_bitmap(disk);
+        disk_load(disk, sb->bitmap_start * BUFFER_SIZE, (size_t)sb->bitmap_blocks * BUFFER_SIZE, (uint8_t*)disk->bitmap);
+        // The image was enlarged: extend the file system as far as the bitmap reaches.
+        uint32_t blocks = (uint32_t)(disk->size / BUFFER_SIZE);
+        uint32_t limit = sb->bitmap_blocks * BUFFER_SIZE * 8;
+        if (blocks > limit) blocks = limit;
+        if (blocks > sb->total_blocks) {
+            uint32_t old = sb->total_blocks;
+            sb->total_blocks = blocks;
+            fs_mark(disk, old, blocks - old, 0);
+            printf("Disk: Grew file system from %u to %u blocks\n", old, blocks);
+        }
+        fs_alloc_dir(disk);
+        fs_transfer(disk, &sb->dir, 0, sb->dir.size, (uint8_t*)disk->files, XFER_READ);
+    } else {
+        fs_format(disk);
+        struct { char name[MAX_FILENAME]; uint32_t start_addr, size; } old[DIR_INITIAL_ENTRIES];
+        disk_load(disk, OLD_DIR_OFFSET, sizeof(old), (uint8_t*)old);
+        for (int i = 0; i < DIR_INITIAL_ENTRIES; i++) {
+            if (old[i].name[0] == '\0' || memchr(old[i].name, '\0', MAX_FILENAME) == NULL) continue;
+            memcpy(disk->files[i].name, old[i].name, MAX_FILENAME);
+        }
+        memset(disk->dir_dirty, 1, sb->dir.size / BUFFER_SIZE);
+        journal_commit(disk);
+        printf("Disk: Formatted file system (%u blocks of %d bytes)\n", sb->total_blocks, BUFFER_SIZE);
+    }
+    fs_index_build(disk);
+    disk->alloc_cursor = sb->data_start;
+}
+
+uint64_t disk_size(Disk* disk) {
+    return disk->size;
+}
+
+uint16_t disk_status(Disk* disk) {
+    return disk->last_error;
+}
+
+int disk_create_file(Disk* disk, const char* filename) {
+    pthread_mutex_lock(&disk->lock);
+    int ret = disk_create_file_locked(disk, filename);
+    disk_commit_inline(disk);
+    pthread_mutex_unlock(&disk->lock);
+    return ret;
+}
+
+int disk_delete_file(Disk* disk, const char* filename) {
+    pthread_mutex_lock(&disk->lock);
+    int ret = disk_delete_file_locked(disk, filename);
+    disk_commit_inline(disk);
+    pthread_mutex_unlock(&disk->lock);
+    return ret;
+}
+
+static int disk_create_file_locked(Disk* disk, const char* filename) {
+    if (fs_lookup(disk, filename)) {
+        disk->last_error = 5;
+        fprintf(stderr, "Disk error: File %s already exists\n", filename);
+        return 1;
+    }
+    if (disk->free_count == 0 && fs_grow_dir(disk) != 0) {
+        disk->last_error = 2;
+        fprintf(stderr, "Disk error: No space to grow the directory\n");
+        return 1;
+    }
+
+    int idx = disk->free_slots[--disk->free_count];
+    memset(&disk->files[idx], 0, sizeof(FileEntry));
+    strncpy(disk->files[idx].name, filename, MAX_FILENAME - 1);
+    fs_index_insert(disk, idx);
+    fs_touch(disk, &disk->files[idx]);
+    disk->file_count++;
+    disk->last_error = 0;
+    return 0;
+}
+
+static int disk_delete_file_locked(Disk* disk, const char* filename) {
+    FileEntry* e = fs_lookup(disk, filename);
+    if (!e) {
+        disk->last_error = 3;
+        fprintf(stderr, "Disk error: File %s not found\n", filename);
+        return 1;
+    }
+    int idx = (int)(e - disk->files);
+    fs_index_remove(disk, idx);
+    fs_free_file(disk, e);
+    memset(e, 0, sizeof(FileEntry));
+    fs_touch(disk, e);
+    disk->free_slots[disk->free_count++] = idx;
+    disk->file_count--;
+    disk->last_error = 0;
+    return 0;
+}
+
+// Writes `len` bytes at `offset`, growing the file (and zero-filling any gap
+// past the old end) as needed.
+static int disk_file_write_locked(Disk* disk, const char* filename, uint32_t offset, size_t len, const uint8_t* data) {
+    uint64_t start = now_ns();
+    FileEntry* e = fs_lookup(disk, filename);
+    if (!e) {
+        disk->last_error = 3;
+        fprintf(stderr, "Disk error: File %s not found\n", filename);
+        return 1;
+    }
+    uint64_t end = (uint64_t)offset + len;
+    uint64_t need = (end + BUFFER_SIZE - 1) / BUFFER_SIZE;
+    if (need > disk->sb.total_blocks || fs_grow(disk, e, (uint32_t)need) != 0) {
+        disk->last_error = 4;
+        fprintf(stderr, "Disk error: No space to grow %s to %llu bytes\n", filename, (unsigned long long)end);
+        return 1;
+    }
+    static const uint8_t zero[BUFFER_SIZE];
+    for (uint32_t pos = e->size; pos < offset; ) {
+        size_t n = offset - pos < BUFFER_SIZE ? offset - pos : BUFFER_SIZE;
+        if (fs_transfer(disk, e, pos, n, (uint8_t*)zero, XFER_WRITE) != 0) {
+            disk->last_error = 1;
+            return 1;
+        }
+        pos += (uint32_t)n;
+    }
+    if (fs_transfer(disk, e, offset, len, (uint8_t*)data, XFER_WRITE) != 0) {
+        disk->last_error = 1;
+        return 1;
+    }
+    if (end > e->size) {
+        e->size = (uint32_t)end;
+        fs_touch(disk, e);
+    }
+    disk->last_error = 0;
+    metrics_op(disk, DISK_OP_FILE_WRITE, start, len);
+    if (disk->trace) printf("Disk file write: %s offset=%u, len=%zu\n", filename, offset, len);
+    return 0;
+}
+
+// Reads up to `len` bytes at `offset`; *done is the count actually read,
+// short at end of file.
+static int disk_file_read_locked(Disk* disk, const char* filename, uint32_t offset, size_t len, uint8_t* data, size_t* done) {
+    uint64_t start = now_ns();
+    *done = 0;
+    FileEntry* e = fs_lookup(disk, filename);
+    if (!e) {
+        disk->last_error = 3;
+        fprintf(stderr, "Disk error: File %s not found\n", filename);
+        return 1;
+    }
+    if (offset >= e->size) len = 0;
+    else if (len > e->size - offset) len = e->size - offset;
+    if (fs_transfer(disk, e, offset, len, data, XFER_READ) != 0) {
+        disk->last_error = 1;
+        return 1;
+    }
+    *done = len;
+    disk->last_error = 0;
+    metrics_op(disk, DISK_OP_FILE_READ, start, len);
+    if (disk->trace) printf("Disk file read: %s offset=%u, len=%zu\n", filename, offset, len);
+    return 0;
+}
+
+static int compact_cmp(const void* a, const void* b) {
+    uint32_t x = (*(FileEntry* const*)a)->extents[0].start, y = (*(FileEntry* const*)b)->extents[0].start;
+    return (x > y) - (x < y);
+}
+
+// Rewrites files as single extents at the lowest free position, in disk
+// order, dropping preallocated slack. Free space coalesces at the end of the
+// disk and later sequential reads stream from one run. Each file is staged in
+// memory while it moves and is never copied over its own blocks, so an
+// interrupted compact leaves every file intact; running it again packs further.
+static int disk_compact_locked(Disk* disk) {
+    FileEntry** order = (FileEntry**)malloc((size_t)disk->dir_capacity * sizeof(FileEntry*));
+    int n = 0;
+    uint32_t largest = 0;
+    if (!order) return 1;
+    for (uint32_t i = 0; i < disk->dir_capacity; i++) {
+        FileEntry* e = &disk->files[i];
+        if (e->name[0] == '\0' || e->extent_count == 0) continue;
+        order[n++] = e;
+        if (e->size > largest) largest = e->size;
+    }
+    qsort(order, (size_t)n, sizeof(FileEntry*), compact_cmp);
+    uint8_t* buf = (uint8_t*)malloc(largest ? largest : 1);
+    if (!buf) {
+        free(order);
+        return 1;
+    }
+
+    int ret = 0;
+    for (int i = 0; i < n; i++) {
+        FileEntry* e = order[i];
+        uint32_t need = (e->size + BUFFER_SIZE - 1) / BUFFER_SIZE;
+        // Search while the file's own blocks are still allocated so the copy
+        // never overwrites the original; a single-extent file only moves down.
+        uint32_t hi = e->extent_count == 1 ? e->extents[0].start : disk->sb.total_blocks;
+        uint32_t got;
+        uint32_t start = need ? fs_scan(disk, disk->sb.data_start, hi, need, need, &got) : NO_BLOCK;
+        if (start != NO_BLOCK) {
+            if (fs_transfer(disk, e, 0, e->size, buf, XFER_READ) != 0) {
+                ret = 1;
+                continue;
+            }
+            fs_free_file(disk, e);
+            fs_add_extent(disk, e, start, need);
+            if (fs_transfer(disk, e, 0, e->size, buf, XFER_WRITE) != 0) ret = 1;
+        } else if (need == 0) {
+            fs_free_file(disk, e);
+        } else if (e->extent_count == 1 && e->extents[0].count > need) {
+            fs_mark(disk, e->extents[0].start + need, e->extents[0].count - need, 0);
+            e->extents[0].count = need;
+            fs_touch(disk, e);
+        }
+    }
+    free(buf);
+    free(order);
+    disk->alloc_cursor = disk->sb.data_start;
+    disk_flush_locked(disk);
+    return ret;
+}
+
+int disk_file_write(Disk* disk, const char* filename, uint32_t offset, size_t len, const uint8_t* data) {
+    pthread_mutex_lock(&disk->lock);
+    int ret = disk_file_write_locked(disk, filename, offset, len, data);
+    disk_commit_inline(disk);
+    pthread_mutex_unlock(&disk->lock);
+    return ret;
+}
+
+int disk_file_read(Disk* disk, const char* filename, uint32_t offset, size_t len, uint8_t* data, size_t* done) {
+    pthread_mutex_lock(&disk->lock);
+    int ret = disk_file_read_locked(disk, filename, offset, len, data, done);
+    pthread_mutex_unlock(&disk->lock);
+    return ret;
+}
+
+int disk_file_size(Disk* disk, const char* filename, uint32_t* size) {
+    pthread_mutex_lock(&disk->lock);
+    FileEntry* e = fs_lookup(disk, filename);
+    *size = e ? e->size : 0;
+    disk->last_error = e ? 0 : 3;
+    pthread_mutex_unlock(&disk->lock);
+    return e ? 0 : 1;
+}
+
+// Sector writes (INT 10 0x0E) may cover the raw area and blocks the file system
+// has not allocated, but never its superblock, bitmap, directory or file data:
+// the mounted state would no longer match the image. Status 6 if they would.
+int disk_write_sectors(Disk* disk, uint32_t addr, size_t len, const uint8_t* data) {
+    pthread_mutex_lock(&disk->lock);
+    uint64_t end = (uint64_t)addr + len;
+    for (uint64_t b = (addr > FS_RAW_SIZE ? addr : FS_RAW_SIZE) / BUFFER_SIZE;
+         end > FS_RAW_SIZE && b * BUFFER_SIZE < end && b < disk->sb.total_blocks; b++) {
+        if (bit_test(disk->bitmap, (uint32_t)b)) {
+            disk->last_error = 6;
+            pthread_mutex_unlock(&disk->lock);
+            return 1;
+        }
+    }
+    int ret = disk_write_locked(disk, addr, len, data);
+    disk_commit_inline(disk);
+    pthread_mutex_unlock(&disk->lock);
+    return ret;
+}
+
+int disk_compact(Disk* disk) {
+    pthread_mutex_lock(&disk->lock);
+    int ret = disk_compact_locked(disk);
+    disk_commit_inline(disk);
+    pthread_mutex_unlock(&disk->lock);
+    return ret;
+}
+
+void disk_fs_info(Disk* disk, DiskFsInfo* info) {
+    pthread_mutex_lock(&disk->lock);
+    memset(info, 0, sizeof(*info));
+    info->block_size = disk->sb.block_size;
+    info->total_blocks = disk->sb.total_blocks;
+    info->free_blocks = disk->sb.free_blocks;
+    for (uint32_t i = 0; i < disk->dir_capacity; i++) {
+        if (disk->files[i].name[0] == '\0') continue;
+        info->files++;
+        info->extents += disk->files[i].extent_count;
+    }
+    for (uint32_t b = disk->sb.data_start; b < disk->sb.total_blocks; ) {
+        uint32_t run = fs_free_run(disk, b, disk->sb.total_blocks);
+        if (run > info->largest_free) info->largest_free = run;
+        b += run + 1;
+    }
+    for (uint32_t b = 0; disk->cow_map && b < disk->size / BUFFER_SIZE; b++) {
+        info->overlay_blocks += (disk->cow_map[b / 8] >> (b % 8)) & 1;
+    }
+    pthread_mutex_unlock(&disk->lock);
 }
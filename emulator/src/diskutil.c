@@ -0,0 +1,130 @@
+#include "disk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "  %s create <image> [size] [--template <image>] [--preallocate]\n", prog);
+    fprintf(stderr, "  %s info <image>\n", prog);
+    fprintf(stderr, "  %s compact <image>\n", prog);
+    fprintf(stderr, "  %s overlay <base> <overlay>\n", prog);
+    fprintf(stderr, "  %s commit <overlay>\n", prog);
+}
+
+static int cmd_create(int argc, char** argv) {
+    const char* image = NULL;
+    const char* template_path = NULL;
+    uint64_t size = DISK_SIZE;
+    int preallocate = 0;
+    int positional = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--template") == 0 && i + 1 < argc) {
+            template_path = argv[++i];
+        } else if (strcmp(argv[i], "--preallocate") == 0) {
+            preallocate = 1;
+        } else if (positional == 0) {
+            image = argv[i];
+            positional++;
+        } else if (positional == 1) {
+            size = disk_parse_size(argv[i]);
+            if (size < DISK_SIZE || size > DISK_MAX_SIZE) {
+                fprintf(stderr, "Error: Image size must be between %d and %llu bytes\n", DISK_SIZE, DISK_MAX_SIZE);
+                return 1;
+            }
+            positional++;
+        } else {
+            return -1;
+        }
+    }
+    if (!image) return -1;
+    if (disk_create_image(image, size, template_path, preallocate) != 0) {
+        perror(image);
+        return 1;
+    }
+    printf("Created %s (%llu bytes%s)\n", image, (unsigned long long)size,
+           preallocate ? ", preallocated" : "");
+    return 0;
+}
+
+// Overlays are opened on the base recorded in their header.
+static Disk* open_image(const char* image) {
+    static char base[4096];
+    DiskOptions opts;
+    disk_default_options(&opts);
+    opts.path = image;
+    opts.base_path = disk_overlay_base(image, base, sizeof(base)) == 0 ? base : NULL;
+    return disk_open(&opts);
+}
+
+static void print_info(Disk* disk) {
+    DiskFsInfo info;
+    disk_fs_info(disk, &info);
+    printf("%u files in %u extents, %u of %u blocks free (%u bytes each), largest free run %u blocks\n",
+           info.files, info.extents, info.free_blocks, info.total_blocks, info.block_size, info.largest_free);
+    if (info.overlay_blocks) printf("%u blocks in overlay\n", info.overlay_blocks);
+}
+
+static int cmd_info(int argc, char** argv) {
+    if (argc != 1) return -1;
+    Disk* disk = open_image(argv[0]);
+    print_info(disk);
+    disk_cleanup(disk);
+    return 0;
+}
+
+static int cmd_compact(int argc, char** argv) {
+    if (argc != 1) return -1;
+    Disk* disk = open_image(argv[0]);
+    printf("Before: ");
+    print_info(disk);
+    int ret = disk_compact(disk);
+    printf("After:  ");
+    print_info(disk);
+    disk_cleanup(disk);
+    return ret;
+}
+
+static int cmd_overlay(int argc, char** argv) {
+    if (argc != 2) return -1;
+    if (disk_create_overlay(argv[1], argv[0]) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    printf("Created overlay %s on %s\n", argv[1], argv[0]);
+    return 0;
+}
+
+static int cmd_commit(int argc, char** argv) {
+    char base[4096];
+    if (argc != 1) return -1;
+    if (disk_overlay_base(argv[0], base, sizeof(base)) != 0) {
+        fprintf(stderr, "Error: %s is not an overlay image\n", argv[0]);
+        return 1;
+    }
+    Disk* disk = open_image(argv[0]);
+    DiskFsInfo info;
+    disk_fs_info(disk, &info);
+    int ret = disk_commit_overlay(disk);
+    if (ret == 0) printf("Merged %u blocks into %s\n", info.overlay_blocks, base);
+    disk_cleanup(disk);
+    return ret == 0 ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    int rc = -1;
+    if (strcmp(argv[1], "create") == 0) rc = cmd_create(argc - 2, argv + 2);
+    else if (strcmp(argv[1], "info") == 0) rc = cmd_info(argc - 2, argv + 2);
+    else if (strcmp(argv[1], "compact") == 0) rc = cmd_compact(argc - 2, argv + 2);
+    else if (strcmp(argv[1], "overlay") == 0) rc = cmd_overlay(argc - 2, argv + 2);
+    else if (strcmp(argv[1], "commit") == 0) rc = cmd_commit(argc - 2, argv + 2);
+    if (rc < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    return rc;
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 #include <raylib.h>
 #include "cpu.h"
 #include "bios.h"
@@ -9,19 +10,27 @@ typedef struct {
     CPU* cpu;
     BIOS* bios;
     Window* window;
+    const char* profile_path;   // CORX_PROFILE: per-address execution counts, written at exit
 } Emulator;
 static Emulator* emulator_init(size_t memory_size, size_t stack_size) {
     Emulator* emu = (Emulator*)malloc(sizeof(Emulator));
     if (!emu) { printf("Error: Failed to allocate memory for emulator!\n"); exit(1); }
     emu->cpu = cpu_init(memory_size, stack_size);
+    emu->profile_path = getenv("CORX_PROFILE");
+    if (emu->profile_path && cpu_profile_start(emu->cpu) != 0) {
+        printf("Error: Failed to allocate the profile!\n");
+        emu->profile_path = NULL;
+    }
     emu->bios = bios_init();
     emu->window = window_init();
     emu->bios->initial_screen = 1;
     return emu;
 }
 static void emulator_cleanup(Emulator* emu) {
-    cpu_cleanup(emu->cpu);
+    if (emu->profile_path) cpu_profile_write(emu->cpu, emu->profile_path);
+    // The disk worker may still be running async requests into guest memory.
     bios_cleanup(emu->bios);
+    cpu_cleanup(emu->cpu);
     window_cleanup(emu->window);
     free(emu);
 }
@@ -30,24 +39,16 @@ static void handle_menu_input(BIOS* bios, CPU* cpu) {
         if (IsKeyPressed(KEY_UP)) { if (bios->selected_file > 0) bios->selected_file--; }
         if (IsKeyPressed(KEY_DOWN)) { if (bios->selected_file < bios->file_count - 1) bios->selected_file++; }
         if (IsKeyPressed(KEY_ENTER) && bios->file_count > 0) {
-            char filepath[256];
-            snprintf(filepath, sizeof(filepath), "bin/%s", bios->file_list[bios->selected_file]);
-            free(bios->program_file);
-            bios->program_file = strdup(bios->file_list[bios->selected_file]);
-            cpu_load_program(cpu, filepath);
-            if (cpu->program_size > 0) {
+            if (bios_load_program(cpu, bios, bios->selected_file)) {
                 bios->initial_screen = 0;
                 cpu->running = 1;
-            } else {
-                bios->program_file = NULL;
             }
         }
     } else {
         if (IsKeyPressed(KEY_Q)) {
             cpu->running = 0;
             bios->program_file = NULL;
-            free(bios->program_output);
-            bios->program_output = NULL;
+            bios_console_clear(bios);
             bios->initial_screen = 1;
             bios->read_line_active = 0;
         }
@@ -56,12 +57,15 @@ static void handle_menu_input(BIOS* bios, CPU* cpu) {
 static void emulator_run(Emulator* emu) {
     while (!WindowShouldClose()) {
         bios_poll_input(emu->bios);
+        if (emu->bios->initial_screen) bios_refresh_programs(emu->bios);
         handle_menu_input(emu->bios, emu->cpu);
         if (emu->bios->program_file != NULL && emu->cpu->running && !emu->bios->initial_screen) {
             cpu_execute_instruction(emu->cpu);
             bios_handle_interrupt(emu->cpu, emu->bios);
+            bios_service_irqs(emu->cpu, emu->bios);
         }
         window_render(emu->window, emu->bios, emu->cpu);
+        disk_service_metrics(emu->bios->disk);
     }
 }
 int main(int argc, char* argv[]) {
@@ -72,6 +76,7 @@ int main(int argc, char* argv[]) {
         stack_size = (size_t)atoi(argv[2]);
     }
     Emulator* emu = emulator_init(memory_size, stack_size);
+    disk_metrics_signal(SIGUSR1);
     emulator_run(emu);
     emulator_cleanup(emu);
     return 0;
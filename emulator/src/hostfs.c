@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+#include "hostfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Each handle owns one buffer that holds either file data read ahead of the
+// guest or guest writes not yet passed to the host, like a stdio FILE. Reads
+// that continue where the previous one stopped double the readahead window up
+// to HOSTFS_MAX_READAHEAD; reads at least as large as the window go straight
+// into the guest buffer.
+typedef struct {
+    int fd;                     // -1 if the slot is free
+    int flags;
+    uint64_t pos;               // Guest file position
+    uint8_t* buf;
+    size_t cap;
+    uint64_t buf_off;           // File offset of buf[0]
+    size_t buf_len;             // Valid bytes (read) or pending bytes (write)
+    int dirty;                  // buf holds pending writes
+    uint64_t next_read;         // End of the last host read, for sequential detection
+    size_t window;              // Current readahead window
+} HostHandle;
+
+typedef struct {
+    char* name;                 // Directories end in '/'
+    uint64_t size;
+} HostDirEntry;
+
+struct HostFs {
+    int dir_fd;                 // -1 if the directory could not be opened
+    HostHandle handles[HOSTFS_MAX_HANDLES];
+    HostDirEntry* listing;      // Snapshot taken by readdir index 0
+    int listing_count;
+    int last_error;
+};
+
+HostFs* hostfs_init(const char* dir) {
+    HostFs* fs = (HostFs*)calloc(1, sizeof(HostFs));
+    if (!fs) {
+        fprintf(stderr, "Error: Failed to allocate memory for host file system!\n");
+        exit(1);
+    }
+    fs->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fs->dir_fd < 0 && errno != ENOENT) {
+        fprintf(stderr, "HostFS: Failed to open %s: %s\n", dir, strerror(errno));
+    }
+    for (int i = 0; i < HOSTFS_MAX_HANDLES; i++) fs->handles[i].fd = -1;
+    return fs;
+}
+
+static void free_listing(HostFs* fs) {
+    for (int i = 0; i < fs->listing_count; i++) free(fs->listing[i].name);
+    free(fs->listing);
+    fs->listing = NULL;
+    fs->listing_count = 0;
+}
+
+void hostfs_cleanup(HostFs* fs) {
+    for (int i = 0; i < HOSTFS_MAX_HANDLES; i++) {
+        if (fs->handles[i].fd >= 0) hostfs_close(fs, i);
+    }
+    free_listing(fs);
+    if (fs->dir_fd >= 0) close(fs->dir_fd);
+    free(fs);
+}
+
+int hostfs_status(HostFs* fs) {
+    return fs->last_error;
+}
+
+static int fail(HostFs* fs, int status) {
+    fs->last_error = status;
+    return -1;
+}
+
+static int errno_status(void) {
+    switch (errno) {
+        case ENOENT: case ENOTDIR: return HOSTFS_ENOENT;
+        case EEXIST: return HOSTFS_EEXIST;
+        case EINVAL: case EISDIR: case ELOOP: case ENAMETOOLONG: return HOSTFS_EINVAL;
+        default: return HOSTFS_EIO;
+    }
+}
+
+// Guest names are relative to the shared directory and may name files in
+// subdirectories, but never reach outside it.
+static int name_ok(const char* name) {
+    if (name[0] == '\0' || name[0] == '/') return 0;
+    for (const char* p = name; *p; ) {
+        const char* end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len == 2 && p[0] == '.' && p[1] == '.') return 0;
+        p += len;
+        if (*p == '/') p++;
+    }
+    return 1;
+}
+
+// Opens a name that passed name_ok one component at a time, each with
+// O_NOFOLLOW, so a symlinked directory cannot lead outside the shared
+// directory any more than a symlinked file can. Returns an fd or -1 (errno).
+static int open_beneath(HostFs* fs, const char* name, int oflags, mode_t mode) {
+    char path[HOSTFS_NAME_MAX];
+    if (strlen(name) >= sizeof(path)) { errno = ENAMETOOLONG; return -1; }
+    strcpy(path, name);
+    int dir = fs->dir_fd;
+    char* comp = path;
+    for (char* slash; (slash = strchr(comp, '/')) != NULL; comp = slash + 1) {
+        *slash = '\0';
+        if (comp[0] == '\0' || strcmp(comp, ".") == 0) continue;
+        int next = openat(dir, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int err = errno;
+        if (dir != fs->dir_fd) close(dir);
+        if (next < 0) { errno = err; return -1; }
+        dir = next;
+    }
+    int fd = openat(dir, comp, oflags | O_NOFOLLOW, mode);
+    int err = errno;
+    if (dir != fs->dir_fd) close(dir);
+    errno = err;
+    return fd;
+}
+
+static HostHandle* get_handle(HostFs* fs, int handle) {
+    if (handle < 0 || handle >= HOSTFS_MAX_HANDLES || fs->handles[handle].fd < 0) {
+        fail(fs, HOSTFS_EBADF);
+        return NULL;
+    }
+    return &fs->handles[handle];
+}
+
+static int write_full(int fd, const uint8_t* data, size_t len, uint64_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, (off_t)off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n; len -= (size_t)n; off += (uint64_t)n;
+    }
+    return 0;
+}
+
+// Passes pending writes to the host.
+static int handle_flush(HostHandle* h) {
+    if (!h->dirty) return 0;
+    int ret = write_full(h->fd, h->buf, h->buf_len, h->buf_off);
+    h->dirty = 0;
+    h->buf_len = 0;
+    return ret;
+}
+
+static int handle_reserve(HostHandle* h, size_t size) {
+    if (h->cap >= size) return 0;
+    uint8_t* buf = (uint8_t*)realloc(h->buf, size);
+    if (!buf) return -1;
+    h->buf = buf;
+    h->cap = size;
+    return 0;
+}
+
+int hostfs_open(HostFs* fs, const char* name, int flags) {
+    if (!name_ok(name) || !(flags & (HOSTFS_READ | HOSTFS_WRITE))) return fail(fs, HOSTFS_EINVAL);
+    if (fs->dir_fd < 0) return fail(fs, HOSTFS_ENOENT);
+    int slot = 0;
+    while (slot < HOSTFS_MAX_HANDLES && fs->handles[slot].fd >= 0) slot++;
+    if (slot == HOSTFS_MAX_HANDLES) return fail(fs, HOSTFS_EMFILE);
+
+    int oflags = O_CLOEXEC;
+    if ((flags & HOSTFS_READ) && (flags & HOSTFS_WRITE)) oflags |= O_RDWR;
+    else oflags |= (flags & HOSTFS_WRITE) ? O_WRONLY : O_RDONLY;
+    if (flags & HOSTFS_WRITE) {
+        if (flags & HOSTFS_CREATE) oflags |= O_CREAT;
+        if (flags & HOSTFS_EXCL) oflags |= O_EXCL;
+        if (flags & HOSTFS_TRUNCATE) oflags |= O_TRUNC;
+    }
+    int fd = open_beneath(fs, name, oflags, 0644);
+    struct stat st;
+    if (fd < 0) return fail(fs, errno_status());
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return fail(fs, HOSTFS_EINVAL);
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    HostHandle* h = &fs->handles[slot];
+    memset(h, 0, sizeof(*h));
+    h->fd = fd;
+    h->flags = flags;
+    h->pos = (flags & HOSTFS_APPEND) ? (uint64_t)st.st_size : 0;
+    h->window = HOSTFS_BUFFER_SIZE;
+    fs->last_error = 0;
+    return slot;
+}
+
+int hostfs_close(HostFs* fs, int handle) {
+    HostHandle* h = get_handle(fs, handle);
+    if (!h) return -1;
+    int ret = handle_flush(h);
+    if (close(h->fd) != 0) ret = -1;
+    free(h->buf);
+    memset(h, 0, sizeof(*h));
+    h->fd = -1;
+    if (ret != 0) return fail(fs, HOSTFS_EIO);
+    fs->last_error = 0;
+    return 0;
+}
+
+// Reads up to `len` bytes at the handle position. Returns the byte count,
+// 0 at end of file, or -1.
+long hostfs_read(HostFs* fs, int handle, uint8_t* data, size_t len) {
+    HostHandle* h = get_handle(fs, handle);
+    if (!h) return -1;
+    if (!(h->flags & HOSTFS_READ)) return fail(fs, HOSTFS_EBADF);
+    if (handle_flush(h) != 0) return fail(fs, HOSTFS_EIO);
+
+    size_t done = 0;
+    while (done < len) {
+        if (h->pos >= h->buf_off && h->pos < h->buf_off + h->buf_len) {
+            size_t avail = (size_t)(h->buf_off + h->buf_len - h->pos);
+            size_t n = len - done < avail ? len - done : avail;
+            memcpy(data + done, h->buf + (h->pos - h->buf_off), n);
+            done += n;
+            h->pos += n;
+            continue;
+        }
+        if (h->pos == h->next_read) {
+            h->window = h->window * 2 < HOSTFS_MAX_READAHEAD ? h->window * 2 : HOSTFS_MAX_READAHEAD;
+        } else {
+            h->window = HOSTFS_BUFFER_SIZE;
+        }
+        ssize_t n;
+        if (len - done >= h->window) {
+            n = pread(h->fd, data + done, len - done, (off_t)h->pos);
+            if (n > 0) {
+                done += (size_t)n;
+                h->pos += (uint64_t)n;
+            }
+            h->next_read = h->pos;
+        } else {
+            if (handle_reserve(h, h->window) != 0) return fail(fs, HOSTFS_EIO);
+            n = pread(h->fd, h->buf, h->window, (off_t)h->pos);
+            h->buf_off = h->pos;
+            h->buf_len = n > 0 ? (size_t)n : 0;
+            h->next_read = h->buf_off + h->buf_len;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return fail(fs, HOSTFS_EIO);
+        if (n == 0) break;
+    }
+    fs->last_error = 0;
+    return (long)done;
+}
+
+long hostfs_write(HostFs* fs, int handle, const uint8_t* data, size_t len) {
+    HostHandle* h = get_handle(fs, handle);
+    if (!h) return -1;
+    if (!(h->flags & HOSTFS_WRITE)) return fail(fs, HOSTFS_EBADF);
+    if (!h->dirty) h->buf_len = 0;     // Drop read-ahead data; it may be overwritten
+    if (h->dirty && (h->pos != h->buf_off + h->buf_len || h->buf_len + len > h->cap)) {
+        if (handle_flush(h) != 0) return fail(fs, HOSTFS_EIO);
+    }
+    if (len >= HOSTFS_BUFFER_SIZE) {
+        if (handle_flush(h) != 0 || write_full(h->fd, data, len, h->pos) != 0) return fail(fs, HOSTFS_EIO);
+    } else {
+        if (handle_reserve(h, HOSTFS_BUFFER_SIZE) != 0) return fail(fs, HOSTFS_EIO);
+        if (!h->dirty) {
+            h->buf_off = h->pos;
+            h->dirty = 1;
+        }
+        memcpy(h->buf + h->buf_len, data, len);
+        h->buf_len += len;
+    }
+    h->pos += len;
+    fs->last_error = 0;
+    return (long)len;
+}
+
+// Moves the handle position. Returns the new position or -1.
+int64_t hostfs_seek(HostFs* fs, int handle, int64_t offset, int whence) {
+    HostHandle* h = get_handle(fs, handle);
+    if (!h) return -1;
+    int64_t base;
+    if (whence == HOSTFS_SEEK_SET) {
+        base = 0;
+    } else if (whence == HOSTFS_SEEK_CUR) {
+        base = (int64_t)h->pos;
+    } else if (whence == HOSTFS_SEEK_END) {
+        struct stat st;
+        if (fstat(h->fd, &st) != 0) return fail(fs, HOSTFS_EIO);
+        base = st.st_size;
+        if (h->dirty && (int64_t)(h->buf_off + h->buf_len) > base) base = (int64_t)(h->buf_off + h->buf_len);
+    } else {
+        return fail(fs, HOSTFS_EINVAL);
+    }
+    if (base + offset < 0) return fail(fs, HOSTFS_EINVAL);
+    h->pos = (uint64_t)(base + offset);
+    fs->last_error = 0;
+    return (int64_t)h->pos;
+}
+
+static int dir_entry_cmp(const void* a, const void* b) {
+    return strcmp(((const HostDirEntry*)a)->name, ((const HostDirEntry*)b)->name);
+}
+
+// Snapshots the shared directory: regular files and subdirectories, sorted.
+static int scan_listing(HostFs* fs) {
+    free_listing(fs);
+    if (fs->dir_fd < 0) return -1;
+    int fd = openat(fs->dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR* dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    int cap = 0;
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        struct stat st;
+        if (fstatat(fs->dir_fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) continue;
+        if (fs->listing_count == cap) {
+            HostDirEntry* grown = (HostDirEntry*)realloc(fs->listing, (cap ? cap * 2 : 16) * sizeof(HostDirEntry));
+            if (!grown) break;
+            fs->listing = grown;
+            cap = cap ? cap * 2 : 16;
+        }
+        size_t len = strlen(de->d_name);
+        char* copy = (char*)malloc(len + 2);
+        if (!copy) break;
+        HostDirEntry* e = &fs->listing[fs->listing_count++];
+        e->name = copy;
+        memcpy(e->name, de->d_name, len + 1);
+        if (S_ISDIR(st.st_mode)) strcpy(e->name + len, "/");
+        e->size = S_ISDIR(st.st_mode) ? 0 : (uint64_t)st.st_size;
+    }
+    int failed = de != NULL;    // Stopped early: out of memory
+    closedir(dir);
+    if (failed) {
+        free_listing(fs);
+        return -1;
+    }
+    if (fs->listing_count > 1) qsort(fs->listing, fs->listing_count, sizeof(HostDirEntry), dir_entry_cmp);
+    return 0;
+}
+
+// Returns entry `index` of the shared directory; index 0 takes a fresh
+// snapshot so a listing loop sees a consistent view. Names are truncated to
+// `cap`. Returns 0, or -1 past the last entry.
+int hostfs_readdir(HostFs* fs, int index, char* name, size_t cap, uint64_t* size) {
+    if (index == 0 && scan_listing(fs) != 0) return fail(fs, HOSTFS_ENOENT);
+    if (index < 0 || index >= fs->listing_count) return fail(fs, HOSTFS_ENOENT);
+    snprintf(name, cap, "%s", fs->listing[index].name);
+    *size = fs->listing[index].size;
+    fs->last_error = 0;
+    return 0;
+}
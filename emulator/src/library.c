@@ -0,0 +1,234 @@
+#include "library.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#define MAX_IMAGE_SIZE 0x10000 // Whole 16-bit address space
+
+typedef struct {
+    char* name;
+    struct timespec mtime;     // Cache key together with the path
+    off_t size;
+    uint8_t* data;             // Copy of the image, NULL until first use
+} LibraryEntry;
+
+struct Library {
+    char* dir;
+    LibraryEntry* entries;
+    int count;
+    int watch_fd;              // inotify descriptor, -1 if unavailable
+    unsigned generation;       // Bumped whenever the listing is rebuilt
+};
+
+static int is_program_name(const char* name) {
+    size_t len = strlen(name);
+    return len > 4 && strcmp(name + len - 4, ".bin") == 0;
+}
+
+static int entry_cmp(const void* a, const void* b) {
+    return strcmp(((const LibraryEntry*)a)->name, ((const LibraryEntry*)b)->name);
+}
+
+static void entry_release(LibraryEntry* e) {
+    free(e->data);
+    e->data = NULL;
+}
+
+static LibraryEntry* library_find(Library* lib, const char* name) {
+    for (int i = 0; i < lib->count; i++) {
+        if (strcmp(lib->entries[i].name, name) == 0) return &lib->entries[i];
+    }
+    return NULL;
+}
+
+// Rebuilds the listing from the directory, keeping copies whose mtime and
+// size are unchanged so a rescan never re-reads images that did not change.
+static void library_scan(Library* lib) {
+    DIR* dir = opendir(lib->dir);
+    if (!dir) {
+        fprintf(stderr, "Library: Failed to open %s directory: %s\n", lib->dir, strerror(errno));
+        return;
+    }
+    LibraryEntry* fresh = NULL;
+    int n = 0, cap = 0;
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (!is_program_name(de->d_name)) continue;
+        char path[512];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", lib->dir, de->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            fresh = (LibraryEntry*)realloc(fresh, cap * sizeof(LibraryEntry));
+            if (!fresh) {
+                fprintf(stderr, "Error: Failed to allocate memory for program library!\n");
+                exit(1);
+            }
+        }
+        LibraryEntry* e = &fresh[n++];
+        memset(e, 0, sizeof(*e));
+        e->name = strdup(de->d_name);
+        if (!e->name) {
+            fprintf(stderr, "Error: Failed to allocate memory for program library!\n");
+            exit(1);
+        }
+        e->mtime = st.st_mtim;
+        e->size = st.st_size;
+        LibraryEntry* old = library_find(lib, e->name);
+        if (old && old->data && old->size == e->size &&
+            old->mtime.tv_sec == e->mtime.tv_sec && old->mtime.tv_nsec == e->mtime.tv_nsec) {
+            e->data = old->data;
+            old->data = NULL;
+        }
+    }
+    closedir(dir);
+    if (n > 1) qsort(fresh, n, sizeof(LibraryEntry), entry_cmp);
+
+    for (int i = 0; i < lib->count; i++) {
+        entry_release(&lib->entries[i]);
+        free(lib->entries[i].name);
+    }
+    free(lib->entries);
+    lib->entries = fresh;
+    lib->count = n;
+    lib->generation++;
+}
+
+Library* library_init(const char* dir) {
+    Library* lib = (Library*)calloc(1, sizeof(Library));
+    if (!lib) {
+        fprintf(stderr, "Error: Failed to allocate memory for program library!\n");
+        exit(1);
+    }
+    lib->dir = strdup(dir);
+    if (!lib->dir) {
+        fprintf(stderr, "Error: Failed to allocate memory for program library!\n");
+        exit(1);
+    }
+    lib->watch_fd = -1;
+#ifdef __linux__
+    lib->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (lib->watch_fd >= 0 &&
+        inotify_add_watch(lib->watch_fd, dir, IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO) < 0) {
+        close(lib->watch_fd);
+        lib->watch_fd = -1;
+    }
+#endif
+    library_scan(lib);
+    return lib;
+}
+
+void library_cleanup(Library* lib) {
+    for (int i = 0; i < lib->count; i++) {
+        entry_release(&lib->entries[i]);
+        free(lib->entries[i].name);
+    }
+    if (lib->watch_fd >= 0) close(lib->watch_fd);
+    free(lib->entries);
+    free(lib->dir);
+    free(lib);
+}
+
+// Drains pending directory change notifications. Returns 1 if the listing was
+// rebuilt. Without inotify, stale images are caught by library_image instead.
+int library_poll(Library* lib) {
+#ifdef __linux__
+    if (lib->watch_fd < 0) return 0;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t len;
+    while ((len = read(lib->watch_fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + len; ) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            if (ev->len > 0 && is_program_name(ev->name)) changed = 1;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    if (changed) library_scan(lib);
+    return changed;
+#else
+    (void)lib;
+    return 0;
+#endif
+}
+
+unsigned library_generation(Library* lib) {
+    return lib->generation;
+}
+
+int library_count(Library* lib) {
+    return lib->count;
+}
+
+const char* library_name(Library* lib, int index) {
+    return (index >= 0 && index < lib->count) ? lib->entries[index].name : NULL;
+}
+
+// Returns the image for a program, reading it on first use. Programs are
+// rewritten in place (the assembler truncates and writes), so the image is
+// copied with pread rather than mapped: a mapping read past the file's new end
+// raises SIGBUS, a short read is just refused. A cached copy is checked against
+// the file's size and mtime, even after inotify (which includes IN_MODIFY) has
+// had its say.
+const uint8_t* library_image(Library* lib, const char* name, size_t* size) {
+    library_poll(lib);
+    LibraryEntry* e = library_find(lib, name);
+    if (!e) return NULL;
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", lib->dir, e->name);
+
+    if (e->data) {
+        struct stat st;
+        if (stat(path, &st) != 0 || st.st_size != e->size ||
+            st.st_mtim.tv_sec != e->mtime.tv_sec || st.st_mtim.tv_nsec != e->mtime.tv_nsec) {
+            entry_release(e);
+        }
+    }
+    if (!e->data) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "Library: Failed to open %s: %s\n", path, strerror(errno));
+            return NULL;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size > MAX_IMAGE_SIZE) {
+            fprintf(stderr, "Library: %s is not a valid program image\n", path);
+            close(fd);
+            return NULL;
+        }
+        uint8_t* data = (uint8_t*)malloc((size_t)st.st_size);
+        if (!data) {
+            fprintf(stderr, "Error: Failed to allocate memory for program library!\n");
+            exit(1);
+        }
+        size_t got = 0;
+        ssize_t n = 0;
+        while (got < (size_t)st.st_size) {
+            n = pread(fd, data + got, (size_t)st.st_size - got, (off_t)got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            got += (size_t)n;
+        }
+        if (n < 0) fprintf(stderr, "Library: Failed to read %s: %s\n", path, strerror(errno));
+        close(fd);
+        if (got != (size_t)st.st_size) {
+            if (n == 0) fprintf(stderr, "Library: %s shrank while it was read\n", path);
+            free(data);
+            return NULL;
+        }
+        e->data = data;
+        e->size = st.st_size;
+        e->mtime = st.st_mtim;
+    }
+    *size = (size_t)e->size;
+    return e->data;
+}
@@ -0,0 +1,221 @@
+#include "object.h"
+#include "executable.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IMAGE_SIZE 0x10000     // Whole 16-bit address space
+#define DEFAULT_ORG 0x1000
+#define DATA_BASE 0x0100
+
+typedef struct {
+    const char* path;
+    uint8_t* buf;              // Whole file
+    ObjHeader hdr;
+    uint16_t* text;
+    uint8_t* data;
+    ObjSymbol* syms;
+    ObjReloc* relocs;
+    const char* strtab;
+    uint32_t text_addr;        // Where the linker placed this object
+    uint32_t data_addr;
+} Object;
+
+typedef struct { const char* name; Object* obj; uint32_t sym; } Export;
+
+static int load_object(Object* o, const char* path) {
+    FILE* in = fopen(path, "rb");
+    if (!in) { fprintf(stderr, "Cannot open %s\n", path); return -1; }
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    rewind(in);
+    o->path = path;
+    o->buf = (uint8_t*)malloc((size_t)size + 1);
+    if (!o->buf || size < (long)sizeof(ObjHeader) || fread(o->buf, 1, (size_t)size, in) != (size_t)size) {
+        fprintf(stderr, "%s: not an object file\n", path);
+        fclose(in);
+        return -1;
+    }
+    fclose(in);
+    memcpy(&o->hdr, o->buf, sizeof(ObjHeader));
+    ObjHeader* h = &o->hdr;
+    uint64_t need = sizeof(ObjHeader) + (uint64_t)h->text_words * 2 + h->data_size +
+                    (uint64_t)h->nsyms * sizeof(ObjSymbol) + (uint64_t)h->nrelocs * sizeof(ObjReloc) + h->strtab_size;
+    if (h->magic != OBJ_MAGIC || h->version != OBJ_VERSION || need != (uint64_t)size ||
+        (h->strtab_size && o->buf[size - 1] != 0)) {
+        fprintf(stderr, "%s: not an object file (or wrong version)\n", path);
+        return -1;
+    }
+    uint8_t* p = o->buf + sizeof(ObjHeader);
+    o->text = (uint16_t*)p;                 p += (size_t)h->text_words * 2;
+    o->data = p;                            p += h->data_size;
+    // The tables follow byte-sized data, so copy them out to aligned memory.
+    o->syms = (ObjSymbol*)malloc((size_t)h->nsyms * sizeof(ObjSymbol) + 1);
+    o->relocs = (ObjReloc*)malloc((size_t)h->nrelocs * sizeof(ObjReloc) + 1);
+    if (!o->syms || !o->relocs) return -1;
+    memcpy(o->syms, p, (size_t)h->nsyms * sizeof(ObjSymbol));       p += (size_t)h->nsyms * sizeof(ObjSymbol);
+    memcpy(o->relocs, p, (size_t)h->nrelocs * sizeof(ObjReloc));    p += (size_t)h->nrelocs * sizeof(ObjReloc);
+    o->strtab = (const char*)p;
+    for (uint32_t i = 0; i < h->nsyms; i++) {
+        if (o->syms[i].name >= h->strtab_size || o->syms[i].section > OBJ_ABS) {
+            fprintf(stderr, "%s: corrupt symbol table\n", path);
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < h->nrelocs; i++) {
+        if (o->relocs[i].word >= h->text_words || o->relocs[i].sym >= h->nsyms) {
+            fprintf(stderr, "%s: corrupt relocation table\n", path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static const char* sym_name(Object* o, uint32_t i) { return o->strtab + o->syms[i].name; }
+
+static uint32_t sym_addr(Object* o, uint32_t i) {
+    if (o->syms[i].section == OBJ_ABS) return o->syms[i].value;
+    return o->syms[i].value + (o->syms[i].section == OBJ_DATA ? o->data_addr : o->text_addr);
+}
+
+static int export_cmp(const void* a, const void* b) {
+    return strcmp(((const Export*)a)->name, ((const Export*)b)->name);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s -o <output.bin> [--org <addr>] [--flat] <input.o>...\n", prog);
+    fprintf(stderr, "  Text is placed in argument order from the first object's .org (or --org, default 0x%04X)\n", DEFAULT_ORG);
+    fprintf(stderr, "  --flat writes a flat image loaded at 0 instead of a segmented executable\n");
+}
+
+int main(int argc, char** argv) {
+    const char* outpath = NULL;
+    long org = -1;
+    int flat = 0;
+    Object* objs = (Object*)calloc((size_t)argc, sizeof(Object));
+    int nobjs = 0;
+    if (!objs) return 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outpath = argv[++i];
+        } else if (strcmp(argv[i], "--org") == 0 && i + 1 < argc) {
+            char* end;
+            org = strtol(argv[++i], &end, 0);
+            if (*end || org < 0 || org >= IMAGE_SIZE) { fprintf(stderr, "Bad --org '%s'\n", argv[i]); return 1; }
+        } else if (strcmp(argv[i], "--flat") == 0) {
+            flat = 1;
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else if (load_object(&objs[nobjs++], argv[i]) != 0) {
+            return 1;
+        }
+    }
+    if (!outpath || nobjs == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Layout: text back to back, data sections aligned like the assembler aligns dd.
+    if (org < 0) org = objs[0].hdr.text_base ? objs[0].hdr.text_base : DEFAULT_ORG;
+    uint32_t text = (uint32_t)org, data = DATA_BASE;
+    int nexports = 0;
+    for (int i = 0; i < nobjs; i++) {
+        objs[i].text_addr = text;
+        objs[i].data_addr = data;
+        text += objs[i].hdr.text_words * 2;
+        data = (data + objs[i].hdr.data_size + OBJ_DATA_ALIGN - 1) & ~(uint32_t)(OBJ_DATA_ALIGN - 1);
+        for (uint32_t k = 0; k < objs[i].hdr.nsyms; k++) {
+            if (objs[i].syms[k].bind == OBJ_GLOBAL && objs[i].syms[k].section != OBJ_UNDEF) nexports++;
+        }
+    }
+    if (text > IMAGE_SIZE || data > IMAGE_SIZE) {
+        fprintf(stderr, "Program does not fit in 64K (text ends at 0x%X, data at 0x%X)\n", text, data);
+        return 1;
+    }
+    // Both ranges are non-empty and intersect, wherever --org put the text
+    if (text > (uint32_t)org && data > DATA_BASE && (uint32_t)org < data && text > DATA_BASE) {
+        fprintf(stderr, "Data (0x%04X-0x%04X) overlaps text (0x%04X-0x%04X)\n", DATA_BASE, data, (unsigned)org, text);
+        return 1;
+    }
+
+    Export* exports = (Export*)malloc(((size_t)nexports + 1) * sizeof(Export));
+    if (!exports) return 1;
+    nexports = 0;
+    for (int i = 0; i < nobjs; i++) {
+        for (uint32_t k = 0; k < objs[i].hdr.nsyms; k++) {
+            if (objs[i].syms[k].bind != OBJ_GLOBAL || objs[i].syms[k].section == OBJ_UNDEF) continue;
+            exports[nexports++] = (Export){ sym_name(&objs[i], k), &objs[i], k };
+        }
+    }
+    qsort(exports, (size_t)nexports, sizeof(Export), export_cmp);
+    int errors = 0;
+    for (int i = 1; i < nexports; i++) {
+        if (strcmp(exports[i].name, exports[i - 1].name) == 0) {
+            fprintf(stderr, "Error: '%s' defined in both %s and %s\n", exports[i].name,
+                    exports[i - 1].obj->path, exports[i].obj->path);
+            errors++;
+        }
+    }
+
+    uint8_t* image = (uint8_t*)calloc(1, IMAGE_SIZE);
+    if (!image) return 1;
+    for (int i = 0; i < nobjs; i++) {
+        Object* o = &objs[i];
+        for (uint32_t r = 0; r < o->hdr.nrelocs; r++) {
+            ObjReloc* rel = &o->relocs[r];
+            uint32_t addr;
+            if (o->syms[rel->sym].section != OBJ_UNDEF) {
+                addr = sym_addr(o, rel->sym);
+            } else {
+                Export key = { sym_name(o, rel->sym), NULL, 0 };
+                Export* e = (Export*)bsearch(&key, exports, (size_t)nexports, sizeof(Export), export_cmp);
+                if (!e) {
+                    fprintf(stderr, "Error: %s: undefined symbol '%s'\n", o->path, key.name);
+                    errors++;
+                    continue;
+                }
+                addr = sym_addr(e->obj, e->sym);
+            }
+            o->text[rel->word] = (uint16_t)((addr + (uint32_t)rel->addend) & 0xFFFF);
+        }
+        memcpy(image + o->text_addr, o->text, (size_t)o->hdr.text_words * 2);
+        memcpy(image + o->data_addr, o->data, o->hdr.data_size);
+    }
+    if (errors) {
+        fprintf(stderr, "Link failed. No output.\n");
+        return 2;
+    }
+
+    // Executable: one text and one data segment; the gap between data and
+    // text, which the flat layout filled with zeros, becomes BSS.
+    uint32_t end = text > data ? text : data;
+    ExeHeader hdr = { EXE_MAGIC, EXE_VERSION, 0, (uint32_t)org, data, (uint32_t)org > data ? (uint32_t)org - data : 0 };
+    ExeSegment segs[2];
+    if (text > (uint32_t)org) segs[hdr.nsegments++] = (ExeSegment){ (uint32_t)org, text - (uint32_t)org, EXE_TEXT };
+    if (data > DATA_BASE) segs[hdr.nsegments++] = (ExeSegment){ DATA_BASE, data - DATA_BASE, 0 };
+    FILE* out = fopen(outpath, "wb");
+    int ok = out != NULL;
+    if (ok && flat) {
+        ok = fwrite(image, 1, end, out) == end;
+    } else if (ok) {
+        ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1 && fwrite(segs, sizeof(ExeSegment), hdr.nsegments, out) == hdr.nsegments;
+        for (int i = 0; ok && i < hdr.nsegments; i++) ok = fwrite(image + segs[i].addr, 1, segs[i].size, out) == segs[i].size;
+    }
+    if (out && fclose(out) != 0) ok = 0;
+    if (!ok) {
+        fprintf(stderr, "Cannot write %s\n", outpath);
+        return 1;
+    }
+    printf("Linked %d object(s) to %s (org=0x%04X, text_end=0x%04X, data_end=0x%04X)\n",
+           nobjs, outpath, (unsigned)org, (unsigned)text, (unsigned)data);
+    for (int i = 0; i < nobjs; i++) {
+        free(objs[i].buf);
+        free(objs[i].syms);
+        free(objs[i].relocs);
+    }
+    free(objs);
+    free(exports);
+    free(image);
+    return 0;
+}
@@ -0,0 +1,23 @@
+; Regression for -O jump threading: a jump to a "jmp $ + n" must not take
+; over the $ expression, which would then be relative to the wrong address.
+; Nothing here is optimizable, so `make check` expects -O to produce the same
+; binary as a plain build.
+.org 0x1000
+main:
+    mov ax, 1
+    cmp ax, 1
+    jz hop          ; must reach hop's target, not $ + 4 from this jz
+    hlt
+    hlt
+    hlt
+hop:
+    jmp $ + 4
+    hlt
+    hlt
+    mov ax, 2
+    call hop2
+    hlt
+hop2:
+    jmp $ + 4
+    hlt
+    ret